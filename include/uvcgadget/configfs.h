@@ -32,12 +32,24 @@ struct uvc_function_config_interface {
 	unsigned int bInterfaceNumber;
 };
 
+/*
+ * struct uvc_function_config_processing - Processing Unit parameters
+ * @bUnitID: Unit ID, 0 if the function has no Processing Unit
+ * @bmControls: Bitmask of the controls supported by the Processing Unit
+ */
+struct uvc_function_config_processing {
+	unsigned int bUnitID;
+	unsigned int bmControls;
+};
+
 /*
  * struct uvc_function_config_control - Control interface parameters
  * @intf: Generic interface parameters
+ * @processing: Processing Unit parameters
  */
 struct uvc_function_config_control {
 	struct uvc_function_config_interface intf;
+	struct uvc_function_config_processing processing;
 };
 
 /*
@@ -45,6 +57,8 @@ struct uvc_function_config_control {
  * @index: Frame index in the UVC descriptors
  * @width: Frame width in pixels
  * @height: Frame height in pixels
+ * @max_frame_size: Maximum frame size in bytes (dwMaxVideoFrameBufferSize), 0
+ *	if unknown
  * @num_intervals: Number of entries in the intervals array
  * @intervals: Array of frame intervals
  */
@@ -52,6 +66,7 @@ struct uvc_function_config_frame {
 	unsigned int index;
 	unsigned int width;
 	unsigned int height;
+	unsigned int max_frame_size;
 	unsigned int num_intervals;
 	unsigned int *intervals;
 };
@@ -61,6 +76,7 @@ struct uvc_function_config_frame {
  * @index: Format index in the UVC descriptors
  * @guid: Format GUID
  * @fcc: V4L2 pixel format
+ * @bpp: Bits per pixel, summed over all planes, 0 for compressed formats
  * @num_frames: Number of entries in the frames array
  * @frames: Array of frame descriptors
  */
@@ -68,6 +84,7 @@ struct uvc_function_config_format {
 	unsigned int index;
 	uint8_t guid[16];
 	unsigned int fcc;
+	unsigned int bpp;
 	unsigned int num_frames;
 	struct uvc_function_config_frame *frames;
 };
@@ -103,6 +120,9 @@ struct uvc_function_config {
 };
 
 struct uvc_function_config *configfs_parse_uvc_function(const char *function);
+int configfs_parse_uvc_functions(const char * const *functions,
+				 unsigned int count,
+				 struct uvc_function_config **fcs);
 void configfs_free_uvc_function(struct uvc_function_config *fc);
 
 #endif
@@ -15,19 +15,73 @@
 #ifndef __EVENTS_H__
 #define __EVENTS_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 
+#include "histogram.h"
 #include "list.h"
 
+struct event_fd;
+struct event_post_queue;
+struct event_slot;
+struct events_backend;
+struct events_loop_stats;
+struct timer;
+
+/*
+ * struct events - Event loop state
+ * @events: List of watched file descriptors (struct event_fd)
+ * @done: Set to true to stop the event loop
+ * @thread: Thread running the event loop, when started with
+ *	events_start_thread()
+ * @threaded: True if the event loop runs in @thread
+ * @backend: Backend used to wait for events (epoll, or select as a fallback)
+ * @dispatching: True while callbacks are being dispatched
+ * @budget: Maximum number of non high-priority callbacks dispatched per loop
+ *	iteration, 0 for unlimited
+ * @retired: Watches removed during dispatch, freed at the end of the iteration
+ * @slots: Watch handle table
+ * @num_slots: Number of entries in the @slots table
+ * @free_slot: Index of the first free entry in @slots, -1 if none
+ * @epollfd: epoll instance file descriptor, -1 when using the select backend
+ * @postfd: eventfd used to wake up the event loop when work is posted
+ * @posts: Queue of work posted with events_post()
+ * @maxfd: Highest watched file descriptor (select backend only)
+ * @rfds: Read file descriptors set (select backend only)
+ * @wfds: Write file descriptors set (select backend only)
+ * @efds: Exception file descriptors set (select backend only)
+ * @stats: Instrumentation data, NULL when statistics are compiled out
+ */
 struct events {
 	struct list_entry events;
-	bool done;
+	atomic_bool done;
+
+	pthread_t thread;
+	bool threaded;
+
+	const struct events_backend *backend;
+	bool dispatching;
+	struct event_fd *retired;
+	unsigned int budget;
+
+	struct event_slot *slots;
+	unsigned int num_slots;
+	int free_slot;
+
+	int epollfd;
+
+	int postfd;
+	struct event_post_queue *posts;
 
 	int maxfd;
 	fd_set rfds;
 	fd_set wfds;
 	fd_set efds;
+
+	struct events_loop_stats *stats;
 };
 
 enum event_type {
@@ -36,14 +90,272 @@ enum event_type {
 	EVENT_EXCEPTION = 4,
 };
 
-void events_watch_fd(struct events *events, int fd, enum event_type type,
+/*
+ * enum event_priority - Dispatch priority of a watch
+ * @EVENT_PRIORITY_LOW: Background work
+ * @EVENT_PRIORITY_NORMAL: Default priority, used for frame processing
+ * @EVENT_PRIORITY_HIGH: Latency-sensitive events, such as UVC control requests.
+ *	High-priority callbacks are not limited by the dispatch budget
+ *
+ * When multiple watches are ready in the same loop iteration, their callbacks
+ * are called in decreasing priority order.
+ */
+enum event_priority {
+	EVENT_PRIORITY_LOW = 0,
+	EVENT_PRIORITY_NORMAL = 1,
+	EVENT_PRIORITY_HIGH = 2,
+};
+
+/*
+ * struct events_stats - Event loop statistics
+ * @iterations: Number of event loop iterations
+ * @dispatches: Number of callbacks dispatched
+ * @wait: Time spent waiting for events in select() or epoll_wait(), in ns
+ * @delay: Delay between the wakeup of the event loop and the start of each
+ *	callback, in ns
+ */
+struct events_stats {
+	uint64_t iterations;
+	uint64_t dispatches;
+	struct histogram_summary wait;
+	struct histogram_summary delay;
+};
+
+/*
+ * struct events_watch_stats - Statistics of a single watch
+ * @handle: The watch handle
+ * @fd: The watched file descriptor
+ * @type: The event type
+ * @callback: Time spent in the callback, in ns. The number of dispatches is
+ *	stored in the count field
+ */
+struct events_watch_stats {
+	int handle;
+	int fd;
+	enum event_type type;
+	struct histogram_summary callback;
+};
+
+/*
+ * struct events_thread_config - Event loop thread configuration
+ * @cpu: CPU the thread is pinned to, or -1 to let the scheduler decide
+ * @policy: Scheduling policy (SCHED_OTHER, SCHED_FIFO or SCHED_RR)
+ * @priority: Static scheduling priority, for the SCHED_FIFO and SCHED_RR
+ *	policies only
+ */
+struct events_thread_config {
+	int cpu;
+	int policy;
+	int priority;
+};
+
+/*
+ * events_watch_fd - Watch a file descriptor
+ * @events: the event loop
+ * @fd: the file descriptor
+ * @type: the event type
+ * @callback: function called when the event occurs
+ * @priv: private data passed to @callback
+ *
+ * Call @callback from the event loop every time the @type event occurs on @fd.
+ * The watch has EVENT_PRIORITY_NORMAL priority.
+ *
+ * Return a watch handle on success, to be passed to events_unwatch(), or a
+ * negative error code otherwise. Handles are never negative.
+ */
+int events_watch_fd(struct events *events, int fd, enum event_type type,
+		    void(*callback)(void *), void *priv);
+
+/*
+ * events_watch_fd_priority - Watch a file descriptor with a dispatch priority
+ * @events: the event loop
+ * @fd: the file descriptor
+ * @type: the event type
+ * @priority: the dispatch priority
+ * @callback: function called when the event occurs
+ * @priv: private data passed to @callback
+ *
+ * Identical to events_watch_fd(), which uses EVENT_PRIORITY_NORMAL, but lets
+ * the caller select the dispatch @priority.
+ */
+int events_watch_fd_priority(struct events *events, int fd,
+			     enum event_type type,
+			     enum event_priority priority,
+			     void(*callback)(void *), void *priv);
+
+/*
+ * events_unwatch - Remove a watch
+ * @events: the event loop
+ * @handle: the watch handle
+ *
+ * Remove the watch identified by @handle in constant time. This function can be
+ * called from within an event callback, including the callback of the watch
+ * being removed, in which case the watch is retired at the end of the current
+ * loop iteration. Handles are generation-counted, removing a stale handle has
+ * no effect.
+ */
+void events_unwatch(struct events *events, int handle);
+
+/*
+ * events_add_timer - Dispatch timer expirations from the event loop
+ * @events: the event loop
+ * @timer: the timer
+ * @callback: function called when a timer period expires
+ * @priv: private data passed to @callback
+ *
+ * Watch the @timer and call @callback from the event loop when one or more of
+ * its periods have expired. Expirations are consumed before calling @callback,
+ * multiple expirations result in a single call. The timer must be configured
+ * and armed separately with timer_set_fps() and timer_arm().
+ *
+ * Return a watch handle on success, to be passed to events_unwatch() to stop
+ * dispatching the timer, or a negative error code otherwise.
+ */
+int events_add_timer(struct events *events, struct timer *timer,
 		     void(*callback)(void *), void *priv);
-void events_unwatch_fd(struct events *events, int fd, enum event_type type);
 
+/*
+ * events_post - Run a function from the event loop
+ * @events: the event loop
+ * @callback: function to be called
+ * @priv: private data passed to @callback
+ *
+ * Queue @callback to be called from the thread running the event loop. Unlike
+ * all other events functions, this function can be called from any thread
+ * without additional locking. Callbacks are called in the order they have been
+ * posted from any given thread. The event loop is woken up through an eventfd
+ * only if it hasn't been signalled since it last started processing the queue,
+ * posting work in bursts costs no additional system call.
+ *
+ * Posted callbacks that haven't run when events_cleanup() is called are
+ * discarded.
+ *
+ * Return 0 on success or a negative error code otherwise.
+ */
+int events_post(struct events *events, void(*callback)(void *), void *priv);
+
+/*
+ * events_set_budget - Set the per-iteration dispatch budget
+ * @events: the event loop
+ * @budget: the maximum number of callbacks, 0 for unlimited
+ *
+ * Limit the number of normal and low priority callbacks dispatched in a single
+ * loop iteration. Ready watches that exceed the budget are dispatched in the
+ * next iteration, after any high-priority event that occurred in the meantime.
+ * This bounds the delay a burst of frame completions can add to the handling
+ * of UVC control requests.
+ */
+void events_set_budget(struct events *events, unsigned int budget);
+
+/*
+ * events_get_stats - Retrieve the event loop statistics
+ * @events: the event loop
+ * @stats: the statistics
+ *
+ * Statistics are only collected when the library is built with the
+ * events_stats option enabled, and have no run-time cost otherwise. They must
+ * be retrieved from the thread running the event loop.
+ *
+ * Return 0 on success, -ENOTSUP if statistics are compiled out, or -ENOMEM if
+ * the statistics couldn't be allocated when the event loop was initialized.
+ */
+int events_get_stats(struct events *events, struct events_stats *stats);
+
+/*
+ * events_get_watch_stats - Retrieve per-watch statistics
+ * @events: the event loop
+ * @stats: array of statistics to fill
+ * @count: number of entries in the @stats array
+ *
+ * Fill the @stats array with the statistics of up to @count watches, in the
+ * order they have been registered. Removing a watch discards its statistics.
+ *
+ * Return the total number of watches, which may be larger than @count, or
+ * -ENOTSUP if statistics are compiled out.
+ */
+int events_get_watch_stats(struct events *events,
+			   struct events_watch_stats *stats,
+			   unsigned int count);
+
+/*
+ * events_reset_stats - Reset the event loop and per-watch statistics
+ * @events: the event loop
+ */
+void events_reset_stats(struct events *events);
+
+/*
+ * events_loop - Run the event loop
+ * @events: the event loop
+ *
+ * Wait for events and dispatch them in the calling thread until events_stop()
+ * is called.
+ *
+ * Return true if the loop has been stopped due to an error, false otherwise.
+ */
 bool events_loop(struct events *events);
+
+/*
+ * events_stop - Stop the event loop
+ * @events: the event loop
+ *
+ * Stop the event loop at the end of the current iteration. This function can
+ * be called from an event callback, from any other thread, or from a signal
+ * handler. When called from outside of the event loop, it wakes the loop up.
+ */
 void events_stop(struct events *events);
 
+/*
+ * events_start_thread - Run the event loop in a dedicated thread
+ * @events: the event loop
+ * @config: the thread configuration, or NULL to use the default scheduling
+ *	parameters without CPU pinning
+ *
+ * Create a thread that runs the event loop with events_loop(). All watches and
+ * objects using the event loop (such as UVC streams and video sources) should
+ * be set up before starting the thread. Once the thread runs, the event loop
+ * and the objects that use it must only be accessed from event callbacks,
+ * except for events_post() and events_stop(). Work that needs to touch them
+ * from other threads should be posted with events_post().
+ *
+ * The thread blocks all signals, leaving signal handling to the application
+ * threads.
+ *
+ * Selecting a real-time scheduling policy usually requires the CAP_SYS_NICE
+ * capability.
+ *
+ * Return 0 on success or a negative error code otherwise.
+ */
+int events_start_thread(struct events *events,
+			const struct events_thread_config *config);
+
+/*
+ * events_stop_thread - Stop the event loop thread
+ * @events: the event loop
+ *
+ * Stop the event loop and wait for the thread started by events_start_thread()
+ * to exit. This function does nothing if the event loop isn't running in a
+ * dedicated thread.
+ */
+void events_stop_thread(struct events *events);
+
+/*
+ * events_init - Initialize an event loop
+ * @events: the event loop
+ *
+ * Initialize the @events structure. The epoll backend is used when available,
+ * in which case the number and value of watched file descriptors are not
+ * limited by FD_SETSIZE. If the epoll instance can't be created the event loop
+ * falls back to select().
+ */
 void events_init(struct events *events);
+
+/*
+ * events_cleanup - Clean up an event loop
+ * @events: the event loop
+ *
+ * Stop the event loop thread if it is running, and free all resources
+ * associated with the event loop.
+ */
 void events_cleanup(struct events *events);
 
 #endif
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Fan-out video source
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+#ifndef __FANOUT_VIDEO_SOURCE_H__
+#define __FANOUT_VIDEO_SOURCE_H__
+
+#include "video-source.h"
+
+struct events;
+struct fanout_source;
+struct video_source;
+
+/*
+ * A fan-out source shares the buffers of an upstream video source that
+ * allocates its own buffers (such as a V4L2 capture device) between multiple
+ * streams, without copying frames. Each stream is connected to a tap video
+ * source created with fanout_video_source_create(). All taps import the same
+ * dmabufs, and a buffer is only returned to the upstream source once every
+ * streaming tap has released it.
+ *
+ * The format is set by the first tap, other taps must use the same format
+ * while buffers are allocated. The upstream source and all taps must run in
+ * the same event loop.
+ */
+
+/*
+ * fanout_source_create - Create a fan-out source
+ * @upstream: The upstream video source
+ *
+ * On success the fan-out source takes ownership of the @upstream source, which
+ * is then destroyed by fanout_source_destroy().
+ *
+ * Return a pointer to the fan-out source, or NULL if an error occurred.
+ */
+struct fanout_source *fanout_source_create(struct video_source *upstream);
+
+/*
+ * fanout_source_destroy - Destroy a fan-out source
+ * @fanout: The fan-out source
+ *
+ * All taps must have been destroyed before calling this function.
+ */
+void fanout_source_destroy(struct fanout_source *fanout);
+
+struct video_source *fanout_video_source_create(struct fanout_source *fanout);
+void fanout_video_source_init(struct video_source *src, struct events *events);
+
+#endif /* __FANOUT_VIDEO_SOURCE_H__ */
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Latency histograms
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+struct histogram;
+
+/*
+ * struct histogram_summary - Summary of the values recorded in a histogram
+ * @count: Number of recorded values
+ * @min: Smallest recorded value
+ * @max: Largest recorded value
+ * @mean: Mean of the recorded values
+ * @p50: Median
+ * @p90: 90th percentile
+ * @p99: 99th percentile
+ *
+ * All fields but @count are expressed in the unit of the recorded values.
+ * Percentiles are accurate to within 12.5%, and are clamped to [@min, @max].
+ */
+struct histogram_summary {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+};
+
+/*
+ * histogram_new - Create a new histogram
+ *
+ * Histograms use logarithmic buckets with eight linear sub-buckets per power of
+ * two, for a constant relative precision over the whole range of values. They
+ * are meant to record durations in nanoseconds, values larger than 2^40 are
+ * accounted in the last bucket.
+ *
+ * Histograms allocated with this function should be freed with
+ * histogram_destroy().
+ *
+ * Return a pointer to the new histogram, or NULL on allocation failure.
+ */
+struct histogram *histogram_new(void);
+
+/*
+ * histogram_destroy - Free a histogram
+ */
+void histogram_destroy(struct histogram *hist);
+
+/*
+ * histogram_record - Record a value in a histogram
+ *
+ * This function runs in constant time and doesn't allocate memory.
+ */
+void histogram_record(struct histogram *hist, uint64_t value);
+
+/*
+ * histogram_reset - Clear all recorded values
+ */
+void histogram_reset(struct histogram *hist);
+
+/*
+ * histogram_percentile - Compute a percentile of the recorded values
+ * @hist: the histogram
+ * @permille: the percentile, in 1/1000 units (e.g. 990 for the 99th)
+ *
+ * Return the upper bound of the bucket containing the percentile, or 0 if no
+ * value has been recorded.
+ */
+uint64_t histogram_percentile(const struct histogram *hist,
+			      unsigned int permille);
+
+/*
+ * histogram_summarize - Summarize the recorded values
+ */
+void histogram_summarize(const struct histogram *hist,
+			 struct histogram_summary *summary);
+
+#endif /* __HISTOGRAM_H__ */
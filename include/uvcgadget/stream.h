@@ -10,12 +10,84 @@
 #ifndef __STREAM_H__
 #define __STREAM_H__
 
+#include <stdint.h>
+
+#include "histogram.h"
+
 struct events;
 struct uvc_function_config;
 struct uvc_stream;
 struct v4l2_pix_format;
 struct video_source;
 
+/*
+ * enum uvc_stream_rate_policy - Rate matching policy flags
+ * @UVC_STREAM_RATE_DROP: When the source produces frames faster than the host
+ *	consumes them, drop the oldest frames to bound latency
+ * @UVC_STREAM_RATE_REPEAT: When the source doesn't produce a frame in time,
+ *	repeat the last frame to avoid starving the host
+ */
+enum uvc_stream_rate_policy {
+	UVC_STREAM_RATE_DROP = 1 << 0,
+	UVC_STREAM_RATE_REPEAT = 1 << 1,
+};
+
+/*
+ * struct uvc_stream_stats - UVC stream statistics
+ * @sink_queued: Number of buffers queued to the UVC device
+ * @sink_dequeued: Number of buffers completed by the UVC device
+ * @source_queued: Number of buffers handed to the video source for filling
+ * @source_dequeued: Number of frames produced by the video source
+ * @bytes: Number of bytes of video data transferred by the UVC device
+ * @source_errors: Number of frames discarded due to video source errors
+ * @sink_errors: Number of buffers completed with an error by the UVC device
+ * @underruns: Number of times the UVC device ran out of buffers for more than
+ *	a frame interval
+ * @dropped: Number of frames dropped due to UVC device saturation
+ * @repeated: Number of frames repeated due to video source underruns
+ * @missed_deadlines: Number of frame deadlines missed by the pacing scheduler
+ * @buffers: Total number of buffers
+ * @sink_buffers: Number of buffers currently queued to the UVC device
+ * @source_buffers: Number of buffers currently owned by the video source
+ * @interval: Interval between frames completed by the UVC device, in ns
+ * @latency: Time from frame capture to completion by the UVC device, in ns
+ * @queue_latency: Time from frame capture to queueing to the UVC device, in ns
+ * @transfer_latency: Time from queueing to completion by the UVC device, in ns,
+ *	which approximates the time spent waiting for and on the bus
+ * @time_to_first_frame: Time from the stream start request by the host to the
+ *	completion of the first frame by the UVC device, in ns, 0 until then
+ *
+ * Buffers owned neither by the UVC device nor by the video source are held by
+ * the stream for rate matching, or taken out of circulation. The capture time
+ * is the buffer timestamp for video sources that provide one, and the time at
+ * which the stream received the frame or started filling the buffer otherwise.
+ * Repeated frames are not accounted in @latency and @queue_latency.
+ */
+struct uvc_stream_stats {
+	uint64_t sink_queued;
+	uint64_t sink_dequeued;
+	uint64_t source_queued;
+	uint64_t source_dequeued;
+	uint64_t bytes;
+	uint64_t source_errors;
+	uint64_t sink_errors;
+	uint64_t underruns;
+	uint64_t dropped;
+	uint64_t repeated;
+	uint64_t missed_deadlines;
+
+	unsigned int buffers;
+	unsigned int sink_buffers;
+	unsigned int source_buffers;
+
+	struct histogram_summary interval;
+	struct histogram_summary latency;
+	struct histogram_summary queue_latency;
+	struct histogram_summary transfer_latency;
+
+	uint64_t time_to_first_frame;
+};
+
 /*
  * uvc_stream_new - Create a new UVC stream
  * @uvc_device: Filename of UVC device node
@@ -57,6 +129,10 @@ void uvc_stream_init_uvc(struct uvc_stream *stream,
  *
  * This function sets the event handler that the stream can use to be notified
  * of file descriptor events.
+ *
+ * Each stream can use its own event handler, run in a dedicated thread with
+ * events_start_thread(). The stream and its video source are then only
+ * accessed from that thread, and don't share any state with other streams.
  */
 void uvc_stream_set_event_handler(struct uvc_stream *stream,
 				  struct events *events);
@@ -64,6 +140,216 @@ void uvc_stream_set_event_handler(struct uvc_stream *stream,
 void uvc_stream_set_video_source(struct uvc_stream *stream,
 				 struct video_source *src);
 
+/*
+ * uvc_stream_switch_video_source - Replace the video source of a stream
+ * @stream: the UVC stream
+ * @src: the new video source
+ *
+ * Replace the video source of the @stream, which may be running. The new source
+ * is configured with the current format and frame rate, and started before the
+ * current source is stopped. The sources are then swapped on a frame boundary,
+ * without stopping the UVC device, and the host doesn't see a gap in the
+ * stream. The previous source is left stopped, and is not destroyed.
+ *
+ * The UVC device buffers can't be reallocated while streaming, which limits the
+ * switches possible on a running stream:
+ *
+ * - Sources that fill buffers (test pattern, still images) can always replace
+ *   the current source. When the current buffers have been allocated by a
+ *   video source (a V4L2 capture device), they are mapped to be filled by the
+ *   new source, without cache synchronization.
+ * - The source that allocated the buffers can then be switched back to. As it
+ *   needs all buffers before starting, the switch completes once the UVC
+ *   device has transferred the queued frames, which leaves a gap of a few
+ *   frames.
+ * - Switching to any other source that allocates buffers fails with -EBUSY,
+ *   and requires the host to restart the stream.
+ *
+ * When the stream isn't running, any source can be switched to, and the
+ * buffers are reallocated at the next start if needed.
+ *
+ * This function must be called from the thread running the event loop of the
+ * stream, and all video sources must use that event loop.
+ *
+ * Returns 0 on success, or a negative error code on failure.
+ */
+int uvc_stream_switch_video_source(struct uvc_stream *stream,
+				   struct video_source *src);
+
+/*
+ * uvc_stream_reload_video_source - Reload the assets of a video source
+ * @stream: the UVC stream
+ * @src: the video source
+ *
+ * Reload @src with video_source_reload(). When @src is the source of the
+ * stream and its buffers are filled by worker threads, the workers are paused
+ * and the buffers being filled are waited for before reloading, as the fill
+ * operation of the source can't run concurrently with the reload.
+ *
+ * This function must be called from the thread running the event loop of the
+ * stream.
+ *
+ * Return 0 on success, -ENOTSUP if the video source doesn't support reloading,
+ * or another negative error code otherwise.
+ */
+int uvc_stream_reload_video_source(struct uvc_stream *stream,
+				   struct video_source *src);
+
+typedef void(*uvc_stream_still_handler_t)(void *data,
+					  const struct v4l2_pix_format *format,
+					  const void *mem, unsigned int size);
+
+/*
+ * uvc_stream_set_still_source - Set the video source for still images
+ * @stream: the UVC stream
+ * @src: the still image video source, NULL to disable still image capture
+ * @handler: function called with each captured still image
+ * @data: private data passed to @handler
+ *
+ * Still images are captured on request with uvc_stream_capture_still(). Each
+ * capture sets the format of @src to the requested still image format and
+ * takes a single frame, into a buffer separate from the stream buffers. The
+ * video stream keeps running, its source and buffers are left untouched. @src
+ * must thus not be the video source of the stream, and is typically a second
+ * capture device on the full resolution output of the sensor.
+ *
+ * Sources that fill buffers fill the still image buffer directly. Sources that
+ * allocate buffers are only started for the duration of the capture, and their
+ * frame is copied to the still image buffer.
+ *
+ * The captured image is passed to @handler, from the event loop of the stream.
+ * The image memory is only valid for the duration of the call.
+ *
+ * Still images are not sent to the host. UVC still image capture methods 2 and
+ * 3 require the image to be sent over the video endpoint with the STI bit set
+ * in the payload headers, which the UVC gadget kernel driver doesn't support.
+ * The still image controls are thus not implemented, and requests from the
+ * host to those controls are stalled.
+ *
+ * @src must use the event loop of the stream.
+ */
+void uvc_stream_set_still_source(struct uvc_stream *stream,
+				 struct video_source *src,
+				 uvc_stream_still_handler_t handler,
+				 void *data);
+
+/*
+ * uvc_stream_set_buffer_count - Set the number of video buffers
+ * @stream: the UVC stream
+ * @count: the number of buffers, or 0 to select the number automatically
+ *
+ * Set the number of buffers circulating between the video source and the UVC
+ * device. Deeper queues absorb more jitter from the video source at the
+ * expense of latency. The value is clamped to the [2, 32] range, and takes
+ * effect the next time the stream is started.
+ *
+ * When @count is 0, the stream monitors sink underruns and the time buffers
+ * spend in the sink queue, and adjusts the number of buffers at runtime to the
+ * lowest value that doesn't cause underruns.
+ *
+ * The default is 4 buffers.
+ */
+void uvc_stream_set_buffer_count(struct uvc_stream *stream, unsigned int count);
+
+/*
+ * uvc_stream_set_rate_policy - Set the rate matching policy
+ * @stream: the UVC stream
+ * @policy: the rate matching policy, a combination of UVC_STREAM_RATE_* flags
+ *
+ * Select how the stream handles video sources that produce frames at a
+ * different rate than the host consumes them. The policy only affects sources
+ * that produce frames asynchronously, such as V4L2 capture devices. Both
+ * UVC_STREAM_RATE_DROP and UVC_STREAM_RATE_REPEAT are enabled by default, 0
+ * queues all frames to the UVC device as soon as they're available.
+ *
+ * The number of dropped and repeated frames is reported when the stream stops.
+ */
+void uvc_stream_set_rate_policy(struct uvc_stream *stream, unsigned int policy);
+
+/*
+ * uvc_stream_set_fill_workers - Set the number of buffer fill worker threads
+ * @stream: the UVC stream
+ * @count: the number of worker threads, or 0 to fill buffers synchronously
+ *
+ * Video sources that neither allocate buffers nor produce frames
+ * asynchronously fill buffers synchronously when the UVC device releases them,
+ * which serializes frame generation with the handling of USB completions in
+ * the event loop. With @count worker threads, buffers released by the UVC
+ * device are instead filled ahead by the workers, in parallel, and the event
+ * loop only dequeues and requeues buffers. Filled buffers are queued to the UVC
+ * device in the order they have been released.
+ *
+ * The fill_buffer operation of the video source is then called concurrently
+ * from the worker threads. Only sources that declare it reentrant with the
+ * VIDEO_SOURCE_FILL_REENTRANT flag are filled by the workers, other sources
+ * are always filled synchronously. The value is limited to 8 workers and
+ * takes effect the next time the stream is started.
+ *
+ * The default is 0.
+ */
+void uvc_stream_set_fill_workers(struct uvc_stream *stream, unsigned int count);
+
+/*
+ * uvc_stream_set_prewarm - Enable or disable pre-warming of the stream
+ * @stream: the UVC stream
+ * @enable: 0 to disable pre-warming, 1 to enable it
+ *
+ * Hosts usually commit the streaming parameters well before they start the
+ * stream. When pre-warming is enabled, the stream is prepared by
+ * uvc_stream_prewarm() as soon as the format is committed: buffers are
+ * allocated, the video source is started, and the first frames are filled.
+ * Starting the stream then only starts the UVC device, which shortens the time
+ * to the first frame, reported in struct uvc_stream_stats.
+ *
+ * The video source runs from the commit until the host starts the stream.
+ * Sources that capture frames keep only the most recent frame until then.
+ * Pre-warming is undone if the format or frame interval changes, or when the
+ * host stops the stream without starting it.
+ *
+ * Pre-warming is disabled by default.
+ */
+void uvc_stream_set_prewarm(struct uvc_stream *stream, int enable);
+
+/*
+ * uvc_stream_prewarm - Prepare the stream ahead of the start
+ * @stream: the UVC stream
+ *
+ * Prepare the stream with the current format and frame interval, if
+ * pre-warming is enabled and the stream isn't running or prepared already.
+ * This function is called by the UVC protocol handler when the host commits
+ * the streaming parameters.
+ *
+ * Returns 0 on success, or a negative error code on failure.
+ */
+int uvc_stream_prewarm(struct uvc_stream *stream);
+
+/*
+ * uvc_stream_set_latency_threshold - Set the latency logging threshold
+ * @stream: the UVC stream
+ * @threshold: the threshold in ns, 0 to disable logging
+ *
+ * Log frames whose time from capture to completion by the UVC device exceeds
+ * @threshold, with the time spent before and after queueing to the UVC device.
+ * Messages are limited to one per second, and report the number of frames over
+ * the threshold since the previous message.
+ *
+ * Logging is disabled by default.
+ */
+void uvc_stream_set_latency_threshold(struct uvc_stream *stream,
+				      uint64_t threshold);
+
+/*
+ * uvc_stream_get_stats - Retrieve the stream statistics
+ * @stream: the UVC stream
+ * @stats: the statistics
+ *
+ * Fill @stats with the statistics accumulated since the stream was last
+ * started. This function must be called from the thread running the event loop
+ * of the stream, for instance through events_post().
+ */
+void uvc_stream_get_stats(struct uvc_stream *stream,
+			  struct uvc_stream_stats *stats);
+
 /*
  * uvc_stream_delete - Delete a UVC stream
  * @stream: the UVC stream
@@ -95,13 +381,65 @@ int uvc_stream_set_format(struct uvc_stream *stream,
  * @stream: the UVC stream
  * @fps:    the frame rate in frames per second
  *
+ * Equivalent to uvc_stream_set_frame_interval() with the interval rounded down
+ * to 100ns units. Integer frame rates can't express fractional rates such as
+ * 29.97 fps, uvc_stream_set_frame_interval() should be preferred. It must not
+ * be called directly by applications.
+ *
+ * Returns 0 on success, or a negative error code on failure.
+ */
+int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps);
+
+/*
+ * uvc_stream_set_frame_interval - Set the frame interval for the stream
+ * @stream: the UVC stream
+ * @interval: the frame interval in 100ns units, as in dwFrameInterval
+ *
  * This function is called from the UVC protocol handler to configure the frame
- * rate for the video source of the @stream. It must not be called directly by
+ * interval committed by the host. The interval is used as is to pace frames,
+ * and passed unchanged to the video source, so fractional frame rates such as
+ * 29.97 fps are delivered exactly. It must not be called directly by
  * applications.
  *
+ * Video sources that fill buffers synchronously are paced by the stream: filled
+ * buffers are queued to the UVC device at absolute deadlines spaced by
+ * @interval on CLOCK_MONOTONIC. Deadlines that pass without a frame being
+ * available are skipped and counted as missed, frames are never sent in bursts
+ * to catch up.
+ *
  * Returns 0 on success, or a negative error code on failure.
  */
-int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps);
+int uvc_stream_set_frame_interval(struct uvc_stream *stream,
+				  unsigned int interval);
+
+/*
+ * uvc_stream_capture_still - Capture a still image
+ * @stream: the UVC stream
+ * @format: the still image format
+ *
+ * Capture a single frame from the still image source of the stream, with the
+ * given @format. A zero pixelformat selects the pixel format of the video
+ * stream. The format is adjusted by the video source, V4L2 devices use the
+ * closest size they support, and an oversized request thus captures at the
+ * largest resolution of the device. The capture completes asynchronously, see
+ * uvc_stream_set_still_source().
+ *
+ * This function must be called from the thread running the event loop of the
+ * stream.
+ *
+ * Returns 0 on success, or a negative error code on failure.
+ */
+int uvc_stream_capture_still(struct uvc_stream *stream,
+			     const struct v4l2_pix_format *format);
+
+/*
+ * uvc_stream_cancel_still - Abort a still image capture
+ * @stream: the UVC stream
+ *
+ * Abort the still image capture in progress, if any. The still image handler
+ * isn't called.
+ */
+void uvc_stream_cancel_still(struct uvc_stream *stream);
 
 /*
  * uvc_stream_enable - Turn on/off video streaming for the UVC stream
@@ -7,15 +7,20 @@
  * Contact: Daniel Scally <dan.scally@ideasonboard.com>
  */
 
+#include <stdint.h>
+
 struct timer;
 
 /*
  * timer_new - Create a new timer
  *
  * Allocates and returns a new struct timer. This must be configured with
- * timer_set_fps() and then armed with timer_arm(), following which calls to
- * timer_wait() will block until the expiration of a period as defined by
- * timer_set_fps().
+ * timer_set_fps() or timer_set_interval() and then armed with timer_arm(),
+ * following which calls to timer_wait() will block until the expiration of a
+ * period as defined by the configured rate.
+ *
+ * Timers are based on CLOCK_MONOTONIC, and are thus not affected by changes to
+ * the system time.
  *
  * Timers allocated with this function should be removed with timer_destroy()
  */
@@ -29,6 +34,15 @@ struct timer *timer_new(void);
  */
 void timer_set_fps(struct timer *timer, int fps);
 
+/*
+ * timer_set_interval - Configure the timer's wait period
+ *
+ * Configure the timer to expire every @ns nanoseconds. Frame intervals in
+ * 100ns units convert exactly, which avoids the drift of timer_set_fps() for
+ * fractional frame rates.
+ */
+void timer_set_interval(struct timer *timer, uint64_t ns);
+
 /*
  * timer_arm
  *
@@ -37,6 +51,26 @@ void timer_set_fps(struct timer *timer, int fps);
  */
 int timer_arm(struct timer *timer);
 
+/*
+ * timer_arm_once
+ *
+ * Arms the timer for a single expiration @ns nanoseconds from now, ignoring the
+ * period configured with timer_set_fps(). Re-arming a timer that hasn't
+ * expired yet replaces the previous expiration time.
+ */
+int timer_arm_once(struct timer *timer, uint64_t ns);
+
+/*
+ * timer_arm_at
+ *
+ * Arms the timer for a single expiration at the absolute CLOCK_MONOTONIC time
+ * @deadline, in nanoseconds, ignoring the period configured with
+ * timer_set_fps(). A deadline in the past expires immediately. Computing
+ * successive deadlines from a fixed origin avoids accumulating the wake-up
+ * latency of relative timers.
+ */
+int timer_arm_at(struct timer *timer, uint64_t deadline);
+
 /*
  * timer_disarm
  *
@@ -51,6 +85,24 @@ int timer_disarm(struct timer *timer);
  */
 void timer_wait(struct timer *timer);
 
+/*
+ * timer_fd
+ *
+ * Return the timer's file descriptor. The file descriptor becomes readable when
+ * a period expires, and is meant to be watched by an event loop instead of
+ * blocking in timer_wait(). See events_add_timer().
+ */
+int timer_fd(struct timer *timer);
+
+/*
+ * timer_expirations
+ *
+ * Consume the expired periods without blocking. Return the number of periods
+ * that expired since the last call to timer_wait() or timer_expirations(), or
+ * 0 if none did.
+ */
+unsigned int timer_expirations(struct timer *timer);
+
 /*
  * timer_destroy
  *
@@ -10,15 +10,24 @@
 #define __VIDEO_SOURCE_H__
 
 struct v4l2_buffer;
+struct v4l2_ext_control;
 struct v4l2_pix_format;
+struct v4l2_queryctrl;
 struct video_buffer;
 struct video_buffer_set;
 struct video_source;
 
+/*
+ * The fill_buffer operation can be called concurrently from multiple threads,
+ * for different buffers.
+ */
+#define VIDEO_SOURCE_FILL_REENTRANT		(1 << 0)
+
 struct video_source_ops {
+	unsigned int flags;
 	void(*destroy)(struct video_source *src);
 	int(*set_format)(struct video_source *src, struct v4l2_pix_format *fmt);
-	int(*set_frame_rate)(struct video_source *src, unsigned int fps);
+	int(*set_frame_interval)(struct video_source *src, unsigned int interval);
 	int(*alloc_buffers)(struct video_source *src, unsigned int nbufs);
 	int(*export_buffers)(struct video_source *src,
 			     struct video_buffer_set **buffers);
@@ -27,6 +36,13 @@ struct video_source_ops {
 	int(*stream_off)(struct video_source *src);
 	int(*queue_buffer)(struct video_source *src, struct video_buffer *buf);
 	void(*fill_buffer)(struct video_source *src, struct video_buffer *buf);
+	int(*reload)(struct video_source *src);
+	int(*query_control)(struct video_source *src,
+			    struct v4l2_queryctrl *query);
+	int(*get_controls)(struct video_source *src, unsigned int count,
+			   struct v4l2_ext_control *ctrls);
+	int(*set_controls)(struct video_source *src, unsigned int count,
+			   struct v4l2_ext_control *ctrls);
 };
 
 typedef void(*video_source_buffer_handler_t)(void *, struct video_source *,
@@ -45,7 +61,18 @@ void video_source_set_buffer_handler(struct video_source *src,
 void video_source_destroy(struct video_source *src);
 int video_source_set_format(struct video_source *src,
 			    struct v4l2_pix_format *fmt);
-int video_source_set_frame_rate(struct video_source *src, unsigned int fps);
+
+/*
+ * video_source_set_frame_interval - Set the frame interval of the video source
+ * @src: the video source
+ * @interval: the frame interval in 100ns units, as in dwFrameInterval
+ *
+ * Sources that generate frames at their own pace must use the interval
+ * exactly, without rounding it to an integer frame rate, so that fractional
+ * rates such as 29.97 fps don't drift.
+ */
+int video_source_set_frame_interval(struct video_source *src,
+				    unsigned int interval);
 int video_source_alloc_buffers(struct video_source *src, unsigned int nbufs);
 int video_source_export_buffers(struct video_source *src,
 				struct video_buffer_set **buffers);
@@ -57,4 +84,60 @@ int video_source_queue_buffer(struct video_source *src,
 void video_source_fill_buffer(struct video_source *src,
 			      struct video_buffer *buf);
 
+/*
+ * video_source_reload - Reload the video source assets
+ * @src: the video source
+ *
+ * Reload the data the video source produces frames from (such as image files)
+ * without stopping the stream. This function must be called from the thread
+ * running the event loop of the video source. If the new data can't be loaded
+ * the video source keeps using the current data.
+ *
+ * Return 0 on success, -ENOTSUP if the video source doesn't support reloading,
+ * or another negative error code otherwise.
+ */
+int video_source_reload(struct video_source *src);
+
+/*
+ * video_source_query_control - Query the parameters of a video source control
+ * @src: the video source
+ * @query: the control query, with the id field set to a V4L2 control ID
+ *
+ * Retrieve the type, range and default value of the V4L2 control @query->id
+ * and store them in @query.
+ *
+ * Return 0 on success, -ENOTSUP if the video source doesn't support controls,
+ * -EINVAL if it doesn't implement the control, or another negative error code
+ * otherwise.
+ */
+int video_source_query_control(struct video_source *src,
+			       struct v4l2_queryctrl *query);
+
+/*
+ * video_source_get_controls - Read the value of video source controls
+ * @src: the video source
+ * @count: the number of controls
+ * @ctrls: the controls, identified by V4L2 control ID
+ *
+ * Return 0 on success, -ENOTSUP if the video source doesn't support controls,
+ * or another negative error code otherwise.
+ */
+int video_source_get_controls(struct video_source *src, unsigned int count,
+			      struct v4l2_ext_control *ctrls);
+
+/*
+ * video_source_set_controls - Write the value of video source controls
+ * @src: the video source
+ * @count: the number of controls
+ * @ctrls: the controls, identified by V4L2 control ID
+ *
+ * Set all controls in a single operation. The video source may adjust the
+ * values, in which case @ctrls is updated with the values applied.
+ *
+ * Return 0 on success, -ENOTSUP if the video source doesn't support controls,
+ * or another negative error code otherwise.
+ */
+int video_source_set_controls(struct video_source *src, unsigned int count,
+			      struct v4l2_ext_control *ctrls);
+
 #endif /* __VIDEO_SOURCE_H__ */
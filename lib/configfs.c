@@ -154,6 +154,21 @@ static int attribute_read_uint(const char *path, const char *file,
 	return 0;
 }
 
+static bool attribute_exists(const char *path, const char *file)
+{
+	bool exists;
+	char *f;
+
+	f = path_join(path, file);
+	if (!f)
+		return false;
+
+	exists = !access(f, R_OK);
+	free(f);
+
+	return exists;
+}
+
 static char *attribute_read_str(const char *path, const char *file)
 {
 	char buf[1024];
@@ -251,20 +266,40 @@ static char *udc_find_video_device(const char *udc, const char *function)
 #define UVC_GUID_FORMAT_YUY2 \
 	{ 'Y',  'U',  'Y',  '2', 0x00, 0x00, 0x10, 0x00, \
 	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_NV12 \
+	{ 'N',  'V',  '1',  '2', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
 
+/*
+ * struct uvc_function_format_info - Format descriptor information
+ * @guid: Format GUID
+ * @fcc: V4L2 pixel format
+ * @bpp: Bits per pixel, summed over all planes, 0 for compressed formats
+ *
+ * Planes of multi-planar formats are stored contiguously, the frame size is
+ * thus computed from the number of bits per pixel of all planes.
+ */
 struct uvc_function_format_info {
 	uint8_t guid[16];
 	uint32_t fcc;
+	unsigned int bpp;
 };
 
-static struct uvc_function_format_info uvc_formats[] = {
+static const struct uvc_function_format_info uvc_formats[] = {
 	{
 		.guid		= UVC_GUID_FORMAT_YUY2,
 		.fcc		= V4L2_PIX_FMT_YUYV,
+		.bpp		= 16,
+	},
+	{
+		.guid		= UVC_GUID_FORMAT_NV12,
+		.fcc		= V4L2_PIX_FMT_NV12,
+		.bpp		= 12,
 	},
 	{
 		.guid		= UVC_GUID_FORMAT_MJPEG,
 		.fcc		= V4L2_PIX_FMT_MJPEG,
+		.bpp		= 0,
 	},
 };
 
@@ -277,6 +312,10 @@ static const struct uvc_function_config g_webcam_config = {
 		.intf = {
 			.bInterfaceNumber = 0,
 		},
+		.processing = {
+			.bUnitID = 2,
+			.bmControls = 1,
+		},
 	},
 	.streaming = {
 		.intf = {
@@ -293,12 +332,14 @@ static const struct uvc_function_config g_webcam_config = {
 				.index = 1,
 				.guid = UVC_GUID_FORMAT_YUY2,
 				.fcc = V4L2_PIX_FMT_YUYV,
+				.bpp = 16,
 				.num_frames = 2,
 				.frames = (struct uvc_function_config_frame[]) {
 					{
 						.index = 1,
 						.width = 640,
 						.height = 360,
+						.max_frame_size = 460800,
 						.num_intervals = 3,
 						.intervals = (unsigned int[]) {
 							666666,
@@ -309,6 +350,7 @@ static const struct uvc_function_config g_webcam_config = {
 						.index = 2,
 						.width = 1280,
 						.height = 720,
+						.max_frame_size = 1843200,
 						.num_intervals = 1,
 						.intervals = (unsigned int[]) {
 							50000000,
@@ -325,6 +367,7 @@ static const struct uvc_function_config g_webcam_config = {
 						.index = 1,
 						.width = 640,
 						.height = 360,
+						.max_frame_size = 460800,
 						.num_intervals = 3,
 						.intervals = (unsigned int[]) {
 							666666,
@@ -335,6 +378,7 @@ static const struct uvc_function_config g_webcam_config = {
 						.index = 2,
 						.width = 1280,
 						.height = 720,
+						.max_frame_size = 1843200,
 						.num_intervals = 1,
 						.intervals = (unsigned int[]) {
 							50000000,
@@ -440,25 +484,22 @@ static char *configfs_mount_point(void)
 
 /*
  * configfs_find_uvc_function - Find the ConfigFS full path for a UVC function
+ * @configfs: The ConfigFS mount point
  * @function: The UVC function name
  *
  * Return a pointer to a newly allocated string containing the full ConfigFS
  * path to the function if the function is found. Otherwise return NULL. The
  * returned pointer must be freed by the caller with a call to free().
  */
-static char *configfs_find_uvc_function(const char *function)
+static char *configfs_find_uvc_function(const char *configfs,
+					const char *function)
 {
 	const char *target = function ? function : "*";
 	const char *format;
-	char *configfs;
 	char *func_path;
 	char *path;
 	int ret;
 
-	configfs = configfs_mount_point();
-	if (!configfs)
-		printf("Failed to locate configfs mount point, using default\n");
-
 	/*
 	 * The function description can be provided as a path from the
 	 * usb_gadget root "g1/functions/uvc.0", or if there is no ambiguity
@@ -469,9 +510,7 @@ static char *configfs_find_uvc_function(const char *function)
 	else
 		format = "%s/usb_gadget/%s";
 
-	ret = asprintf(&path, format, configfs ? configfs : "/sys/kernel/config",
-		       target);
-	free(configfs);
+	ret = asprintf(&path, format, configfs, target);
 	if (!ret)
 		return NULL;
 
@@ -540,14 +579,66 @@ static int configfs_parse_interface(const char *path,
 	return ret;
 }
 
+static int configfs_parse_processing(const char *path,
+				     struct uvc_function_config_processing *cfg)
+{
+	unsigned int shift = 0;
+	char *controls;
+	char *p;
+	int ret;
+
+	ret = attribute_read_uint(path, "bUnitID", &cfg->bUnitID);
+	if (ret)
+		return ret;
+
+	/* The bmControls bytes are listed one per line, in decimal. */
+	controls = attribute_read_str(path, "bmControls");
+	if (!controls)
+		return -EINVAL;
+
+	cfg->bmControls = 0;
+
+	for (p = controls; *p && shift < 32; shift += 8) {
+		unsigned int value;
+		char *endp;
+
+		value = strtoul(p, &endp, 10);
+		if (*endp != '\0' && *endp != '\n') {
+			ret = -EINVAL;
+			break;
+		}
+
+		p = *endp ? endp + 1 : endp;
+
+		cfg->bmControls |= (value & 0xff) << shift;
+	}
+
+	free(controls);
+
+	return ret;
+}
+
 static int configfs_parse_control(const char *path,
 				  struct uvc_function_config_control *cfg)
 {
 	int ret;
 
 	ret = configfs_parse_interface(path, &cfg->intf);
+	if (ret)
+		return ret;
 
-	return ret;
+	/*
+	 * The Processing Unit is only needed to handle its controls, don't fail
+	 * if it can't be parsed.
+	 */
+	ret = configfs_parse_child(path, "processing/default", &cfg->processing,
+				   configfs_parse_processing);
+	if (ret) {
+		printf("Failed to parse processing unit, controls disabled\n");
+		memset(&cfg->processing, 0, sizeof cfg->processing);
+	}
+
+	return 0;
 }
 
 static int configfs_parse_streaming_frame(const char *path,
@@ -563,6 +654,14 @@ static int configfs_parse_streaming_frame(const char *path,
 	if (ret)
 		return ret;
 
+	/* The maximum frame size is optional, it's computed when missing. */
+	if (attribute_exists(path, "dwMaxVideoFrameBufferSize")) {
+		ret = attribute_read_uint(path, "dwMaxVideoFrameBufferSize",
+					  &frame->max_frame_size);
+		if (ret)
+			return ret;
+	}
+
 	intervals = attribute_read_str(path, "dwFrameInterval");
 	if (!intervals)
 		return -EINVAL;
@@ -671,10 +770,18 @@ static int configfs_parse_streaming_format(const char *path,
 	for (i = 0; i < ARRAY_SIZE(uvc_formats); ++i) {
 		if (!memcmp(uvc_formats[i].guid, format->guid, 16)) {
 			format->fcc = uvc_formats[i].fcc;
+			format->bpp = uvc_formats[i].bpp;
 			break;
 		}
 	}
 
+	/* Use the descriptor bits per pixel for unknown uncompressed formats. */
+	if (i == ARRAY_SIZE(uvc_formats) && !strcmp(segment, "uncompressed")) {
+		ret = attribute_read_uint(path, "bBitsPerPixel", &format->bpp);
+		if (ret < 0)
+			return ret;
+	}
+
 	/* Find all entries corresponding to a frame and parse them. */
 	n_entries = scandir(path, &entries, frame_filter, alphasort);
 	if (n_entries < 0)
@@ -861,23 +968,8 @@ static int configfs_parse_uvc(const char *fpath,
 	return ret;
 }
 
-/*
- * configfs_parse_uvc_function - Parse a UVC function configuration in ConfigFS
- * @function: The function name
- *
- * This function locates and parse the configuration of a UVC function in
- * ConfigFS as specified by the @function name argument. The function name can
- * be fully qualified with a gadget name (e.g. "g%u/functions/uvc.%u"), or as a
- * shortcut can be an unqualified function name (e.g. "uvc.%u"). When the
- * function name is unqualified, the first function matching the name in any
- * UDC will be returned.
- *
- * Return a pointer to a newly allocated UVC function configuration structure
- * that contains configuration parameters for the function, if the function is
- * found. Otherwise return NULL. The returned pointer must be freed by the
- * caller with a call to free().
- */
-struct uvc_function_config *configfs_parse_uvc_function(const char *function)
+static struct uvc_function_config *
+configfs_parse_function(const char *configfs, const char *function)
 {
 	struct uvc_function_config *fc;
 	char *fpath;
@@ -890,7 +982,7 @@ struct uvc_function_config *configfs_parse_uvc_function(const char *function)
 	memset(fc, 0, sizeof *fc);
 
 	/* Find the function in ConfigFS. */
-	fpath = configfs_find_uvc_function(function);
+	fpath = configfs_find_uvc_function(configfs, function);
 	if (!fpath) {
 		/*
 		 * If the function can't be found attempt legacy parsing to
@@ -932,3 +1024,112 @@ done:
 
 	return fc;
 }
+
+static char *configfs_root(void)
+{
+	char *configfs;
+
+	configfs = configfs_mount_point();
+	if (!configfs) {
+		printf("Failed to locate configfs mount point, using default\n");
+		configfs = strdup("/sys/kernel/config");
+	}
+
+	return configfs;
+}
+
+/*
+ * configfs_parse_uvc_function - Parse a UVC function configuration in ConfigFS
+ * @function: The function name
+ *
+ * This function locates and parse the configuration of a UVC function in
+ * ConfigFS as specified by the @function name argument. The function name can
+ * be fully qualified with a gadget name (e.g. "g%u/functions/uvc.%u"), or as a
+ * shortcut can be an unqualified function name (e.g. "uvc.%u"). When the
+ * function name is unqualified, the first function matching the name in any
+ * UDC will be returned.
+ *
+ * Return a pointer to a newly allocated UVC function configuration structure
+ * that contains configuration parameters for the function, if the function is
+ * found. Otherwise return NULL. The returned pointer must be freed by the
+ * caller with a call to free().
+ */
+struct uvc_function_config *configfs_parse_uvc_function(const char *function)
+{
+	struct uvc_function_config *fc;
+	char *configfs;
+
+	configfs = configfs_root();
+	if (!configfs)
+		return NULL;
+
+	fc = configfs_parse_function(configfs, function);
+	free(configfs);
+
+	return fc;
+}
+
+/*
+ * configfs_parse_uvc_functions - Parse multiple UVC function configurations
+ * @functions: The function names
+ * @count: The number of entries in @functions and @fcs
+ * @fcs: Array filled with the parsed function configurations
+ *
+ * Parse the configuration of all functions in the @functions array, as
+ * configfs_parse_uvc_function() does for a single function, locating ConfigFS
+ * once only. Two names that resolve to the same UVC function are rejected, as
+ * each function can only be handled by a single stream.
+ *
+ * Return 0 on success, in which case all the configurations stored in @fcs must
+ * be freed with configfs_free_uvc_function(), or a negative error code
+ * otherwise, in which case no configuration is returned.
+ */
+int configfs_parse_uvc_functions(const char * const *functions,
+				 unsigned int count,
+				 struct uvc_function_config **fcs)
+{
+	unsigned int i, j;
+	char *configfs;
+	int ret = 0;
+
+	configfs = configfs_root();
+	if (!configfs)
+		return -ENOMEM;
+
+	memset(fcs, 0, count * sizeof(*fcs));
+
+	for (i = 0; i < count; ++i) {
+		fcs[i] = configfs_parse_function(configfs, functions[i]);
+		if (!fcs[i]) {
+			printf("Failed to identify function configuration for %s\n",
+			       functions[i] ? functions[i] : "default function");
+			ret = -ENODEV;
+			break;
+		}
+
+		for (j = 0; j < i; ++j) {
+			if (fcs[i]->video && fcs[j]->video &&
+			    !strcmp(fcs[i]->video, fcs[j]->video)) {
+				printf("Functions %u and %u both resolve to %s\n",
+				       j, i, fcs[i]->video);
+				ret = -EINVAL;
+				break;
+			}
+		}
+
+		if (ret)
+			break;
+	}
+
+	free(configfs);
+
+	if (ret) {
+		for (i = 0; i < count; ++i) {
+			if (fcs[i])
+				configfs_free_uvc_function(fcs[i]);
+			fcs[i] = NULL;
+		}
+	}
+
+	return ret;
+}
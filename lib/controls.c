@@ -0,0 +1,540 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC controls
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+
+#include <errno.h>
+#include <linux/usb/g_uvc.h>
+#include <linux/usb/video.h>
+#include <linux/videodev2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "configfs.h"
+#include "controls.h"
+#include "events.h"
+#include "timer.h"
+#include "tools.h"
+#include "video-source.h"
+
+/*
+ * Hosts send bursts of SET_CUR requests when the user drags a slider. Wait for
+ * 5ms after the first request before forwarding the values to the video source,
+ * only the last value of each control is then applied.
+ */
+#define UVC_CONTROLS_FLUSH_DELAY	(5 * 1000 * 1000)
+
+/*
+ * struct uvc_control_info - Processing Unit control information
+ * @selector: Control selector
+ * @bit: Bit number in the Processing Unit bmControls
+ * @size: Size of the control value in bytes
+ * @is_signed: True if the control value is signed
+ * @cid: V4L2 control ID of the corresponding video source control
+ * @min: Minimum value, when the video source doesn't implement the control
+ * @max: Maximum value, when the video source doesn't implement the control
+ * @def: Default value, when the video source doesn't implement the control
+ */
+struct uvc_control_info {
+	uint8_t selector;
+	uint8_t bit;
+	uint8_t size;
+	bool is_signed;
+	uint32_t cid;
+	int32_t min;
+	int32_t max;
+	int32_t def;
+};
+
+/*
+ * Controls that can't be mapped to a single V4L2 control (white balance
+ * components, digital multiplier and analog video) are not supported.
+ */
+static const struct uvc_control_info uvc_pu_controls[] = {
+	{
+		.selector	= UVC_PU_BRIGHTNESS_CONTROL,
+		.bit		= 0,
+		.size		= 2,
+		.is_signed	= true,
+		.cid		= V4L2_CID_BRIGHTNESS,
+		.min		= 0,
+		.max		= 255,
+		.def		= 128,
+	}, {
+		.selector	= UVC_PU_CONTRAST_CONTROL,
+		.bit		= 1,
+		.size		= 2,
+		.cid		= V4L2_CID_CONTRAST,
+		.min		= 0,
+		.max		= 255,
+		.def		= 128,
+	}, {
+		.selector	= UVC_PU_HUE_CONTROL,
+		.bit		= 2,
+		.size		= 2,
+		.is_signed	= true,
+		.cid		= V4L2_CID_HUE,
+		.min		= -180,
+		.max		= 180,
+		.def		= 0,
+	}, {
+		.selector	= UVC_PU_SATURATION_CONTROL,
+		.bit		= 3,
+		.size		= 2,
+		.cid		= V4L2_CID_SATURATION,
+		.min		= 0,
+		.max		= 255,
+		.def		= 128,
+	}, {
+		.selector	= UVC_PU_SHARPNESS_CONTROL,
+		.bit		= 4,
+		.size		= 2,
+		.cid		= V4L2_CID_SHARPNESS,
+		.min		= 0,
+		.max		= 255,
+		.def		= 128,
+	}, {
+		.selector	= UVC_PU_GAMMA_CONTROL,
+		.bit		= 5,
+		.size		= 2,
+		.cid		= V4L2_CID_GAMMA,
+		.min		= 1,
+		.max		= 500,
+		.def		= 100,
+	}, {
+		.selector	= UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL,
+		.bit		= 6,
+		.size		= 2,
+		.cid		= V4L2_CID_WHITE_BALANCE_TEMPERATURE,
+		.min		= 2800,
+		.max		= 6500,
+		.def		= 4600,
+	}, {
+		.selector	= UVC_PU_BACKLIGHT_COMPENSATION_CONTROL,
+		.bit		= 8,
+		.size		= 2,
+		.cid		= V4L2_CID_BACKLIGHT_COMPENSATION,
+		.min		= 0,
+		.max		= 2,
+		.def		= 1,
+	}, {
+		.selector	= UVC_PU_GAIN_CONTROL,
+		.bit		= 9,
+		.size		= 2,
+		.cid		= V4L2_CID_GAIN,
+		.min		= 0,
+		.max		= 255,
+		.def		= 0,
+	}, {
+		.selector	= UVC_PU_POWER_LINE_FREQUENCY_CONTROL,
+		.bit		= 10,
+		.size		= 1,
+		.cid		= V4L2_CID_POWER_LINE_FREQUENCY,
+		.min		= 0,
+		.max		= 2,
+		.def		= 1,
+	}, {
+		.selector	= UVC_PU_HUE_AUTO_CONTROL,
+		.bit		= 11,
+		.size		= 1,
+		.cid		= V4L2_CID_HUE_AUTO,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+	}, {
+		.selector	= UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL,
+		.bit		= 12,
+		.size		= 1,
+		.cid		= V4L2_CID_AUTO_WHITE_BALANCE,
+		.min		= 0,
+		.max		= 1,
+		.def		= 1,
+	},
+};
+
+/*
+ * struct uvc_control - Processing Unit control state
+ * @info: Static control information
+ * @min: Minimum value
+ * @max: Maximum value
+ * @res: Resolution (step)
+ * @def: Default value
+ * @cur: Current value
+ * @forward: True if the control is implemented by the video source
+ * @set: True if the value has been set by the host
+ * @dirty: True if the value hasn't been applied to the video source yet
+ */
+struct uvc_control {
+	const struct uvc_control_info *info;
+	int32_t min;
+	int32_t max;
+	int32_t res;
+	int32_t def;
+	int32_t cur;
+	bool forward;
+	bool set;
+	bool dirty;
+};
+
+/*
+ * struct uvc_controls - Processing Unit control table
+ * @unit: Processing Unit ID, 0 if the function has no Processing Unit
+ * @src: Video source the controls are applied to
+ * @events: Event loop running the flush timer
+ * @timer: Timer delaying forwarding of the values to the video source
+ * @timer_watch: Handle of the timer watch
+ * @flush_pending: True if the timer is armed
+ * @num_controls: Number of entries in the controls array
+ * @controls: Controls supported by the Processing Unit
+ * @selectors: Controls indexed by control selector
+ */
+struct uvc_controls {
+	unsigned int unit;
+	struct video_source *src;
+
+	struct events *events;
+	struct timer *timer;
+	int timer_watch;
+	bool flush_pending;
+
+	unsigned int num_controls;
+	struct uvc_control controls[ARRAY_SIZE(uvc_pu_controls)];
+	struct uvc_control *selectors[UVC_PU_ANALOG_LOCK_STATUS_CONTROL + 1];
+};
+
+/* -----------------------------------------------------------------------------
+ * Value handling
+ */
+
+static void uvc_control_encode(const struct uvc_control *ctrl, int32_t value,
+			       uint8_t *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctrl->info->size; ++i)
+		data[i] = (uint32_t)value >> (i * 8);
+}
+
+static int32_t uvc_control_decode(const struct uvc_control *ctrl,
+				  const uint8_t *data)
+{
+	unsigned int bits = ctrl->info->size * 8;
+	uint32_t value = 0;
+	unsigned int i;
+
+	for (i = 0; i < ctrl->info->size; ++i)
+		value |= (uint32_t)data[i] << (i * 8);
+
+	if (ctrl->info->is_signed && bits < 32 && (value & (1U << (bits - 1))))
+		value |= ~0U << bits;
+
+	return (int32_t)value;
+}
+
+/* Clamp the value to the control range, and round it down to the resolution. */
+static int32_t uvc_control_adjust(const struct uvc_control *ctrl, int32_t value)
+{
+	value = clamp_t(int32_t, value, ctrl->min, ctrl->max);
+
+	if (ctrl->res > 1)
+		value = ctrl->min + (value - ctrl->min) / ctrl->res * ctrl->res;
+
+	return value;
+}
+
+static struct uvc_control *uvc_controls_find(struct uvc_controls *controls,
+					     uint8_t cs)
+{
+	if (cs >= ARRAY_SIZE(controls->selectors))
+		return NULL;
+
+	return controls->selectors[cs];
+}
+
+/* -----------------------------------------------------------------------------
+ * Video source
+ */
+
+static void uvc_controls_flush(void *d)
+{
+	struct uvc_controls *controls = d;
+	struct v4l2_ext_control ctrls[ARRAY_SIZE(controls->controls)];
+	struct uvc_control *updated[ARRAY_SIZE(controls->controls)];
+	unsigned int count = 0;
+	unsigned int i;
+	int ret;
+
+	controls->flush_pending = false;
+
+	for (i = 0; i < controls->num_controls; ++i) {
+		struct uvc_control *ctrl = &controls->controls[i];
+
+		if (!ctrl->dirty || !ctrl->forward)
+			continue;
+
+		ctrl->dirty = false;
+
+		memset(&ctrls[count], 0, sizeof ctrls[count]);
+		ctrls[count].id = ctrl->info->cid;
+		ctrls[count].value = ctrl->cur;
+		updated[count++] = ctrl;
+	}
+
+	if (!count || !controls->src)
+		return;
+
+	ret = video_source_set_controls(controls->src, count, ctrls);
+	if (ret < 0) {
+		printf("Failed to set %u controls: %s (%d)\n", count,
+		       strerror(-ret), -ret);
+		return;
+	}
+
+	/* The video source may have adjusted the values. */
+	for (i = 0; i < count; ++i)
+		updated[i]->cur = ctrls[i].value;
+}
+
+static void uvc_controls_schedule(struct uvc_controls *controls)
+{
+	if (controls->flush_pending)
+		return;
+
+	if (controls->timer_watch < 0 ||
+	    timer_arm_once(controls->timer, UVC_CONTROLS_FLUSH_DELAY) < 0) {
+		uvc_controls_flush(controls);
+		return;
+	}
+
+	controls->flush_pending = true;
+}
+
+void uvc_controls_set_video_source(struct uvc_controls *controls,
+				   struct video_source *src)
+{
+	struct v4l2_ext_control ctrls[ARRAY_SIZE(controls->controls)];
+	struct uvc_control *read[ARRAY_SIZE(controls->controls)];
+	unsigned int count = 0;
+	bool dirty = false;
+	unsigned int i;
+	int ret;
+
+	controls->src = src;
+	if (!src)
+		return;
+
+	for (i = 0; i < controls->num_controls; ++i) {
+		struct uvc_control *ctrl = &controls->controls[i];
+		struct v4l2_queryctrl query;
+
+		ctrl->forward = false;
+		ctrl->dirty = false;
+
+		memset(&query, 0, sizeof query);
+		query.id = ctrl->info->cid;
+
+		ret = video_source_query_control(src, &query);
+		if (ret < 0 || (query.flags & V4L2_CTRL_FLAG_DISABLED)) {
+			/* Serve the control from the table only. */
+			ctrl->min = ctrl->info->min;
+			ctrl->max = ctrl->info->max;
+			ctrl->res = 1;
+			ctrl->def = ctrl->info->def;
+			ctrl->cur = uvc_control_adjust(ctrl, ctrl->cur);
+			continue;
+		}
+
+		ctrl->min = query.minimum;
+		ctrl->max = query.maximum;
+		ctrl->res = query.step ? : 1;
+		ctrl->def = query.default_value;
+		ctrl->forward = true;
+
+		/*
+		 * Keep the values set by the host, and read the other values
+		 * from the video source.
+		 */
+		if (ctrl->set) {
+			ctrl->cur = uvc_control_adjust(ctrl, ctrl->cur);
+			ctrl->dirty = true;
+			dirty = true;
+			continue;
+		}
+
+		memset(&ctrls[count], 0, sizeof ctrls[count]);
+		ctrls[count].id = ctrl->info->cid;
+		read[count++] = ctrl;
+	}
+
+	if (count) {
+		ret = video_source_get_controls(src, count, ctrls);
+		for (i = 0; i < count; ++i)
+			read[i]->cur = ret < 0 ? read[i]->def : ctrls[i].value;
+	}
+
+	if (dirty)
+		uvc_controls_schedule(controls);
+}
+
+/* -----------------------------------------------------------------------------
+ * Requests
+ */
+
+bool uvc_controls_has_unit(struct uvc_controls *controls, unsigned int unit)
+{
+	return controls->unit && controls->unit == unit;
+}
+
+int uvc_controls_request(struct uvc_controls *controls, uint8_t req,
+			 uint8_t cs, uint16_t len,
+			 struct uvc_request_data *resp)
+{
+	struct uvc_control *ctrl;
+	int32_t value;
+
+	ctrl = uvc_controls_find(controls, cs);
+	if (!ctrl)
+		return -EINVAL;
+
+	switch (req) {
+	case UVC_SET_CUR:
+		resp->length = ctrl->info->size;
+		return 0;
+
+	case UVC_GET_CUR:
+		value = ctrl->cur;
+		break;
+
+	case UVC_GET_MIN:
+		value = ctrl->min;
+		break;
+
+	case UVC_GET_MAX:
+		value = ctrl->max;
+		break;
+
+	case UVC_GET_RES:
+		value = ctrl->res;
+		break;
+
+	case UVC_GET_DEF:
+		value = ctrl->def;
+		break;
+
+	case UVC_GET_INFO:
+		resp->data[0] = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET;
+		resp->length = 1;
+		return 0;
+
+	case UVC_GET_LEN:
+		resp->data[0] = ctrl->info->size;
+		resp->data[1] = 0;
+		resp->length = 2;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+
+	uvc_control_encode(ctrl, value, resp->data);
+	resp->length = min_t(unsigned int, len, ctrl->info->size);
+
+	return 0;
+}
+
+int uvc_controls_set_cur(struct uvc_controls *controls, uint8_t cs,
+			 const struct uvc_request_data *data)
+{
+	struct uvc_control *ctrl;
+	int32_t value;
+
+	ctrl = uvc_controls_find(controls, cs);
+	if (!ctrl || data->length < ctrl->info->size)
+		return -EINVAL;
+
+	value = uvc_control_adjust(ctrl, uvc_control_decode(ctrl, data->data));
+	ctrl->set = true;
+
+	/* Coalesce repeated identical requests. */
+	if (value == ctrl->cur)
+		return 0;
+
+	ctrl->cur = value;
+	ctrl->dirty = true;
+
+	if (ctrl->forward)
+		uvc_controls_schedule(controls);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Control table
+ */
+
+struct uvc_controls *uvc_controls_new(const struct uvc_function_config_control *cfg,
+				      struct events *events)
+{
+	struct uvc_controls *controls;
+	unsigned int i;
+	int ret;
+
+	controls = malloc(sizeof *controls);
+	if (!controls)
+		return NULL;
+
+	memset(controls, 0, sizeof *controls);
+	controls->unit = cfg->processing.bUnitID;
+	controls->events = events;
+	controls->timer_watch = -1;
+
+	for (i = 0; i < ARRAY_SIZE(uvc_pu_controls); ++i) {
+		const struct uvc_control_info *info = &uvc_pu_controls[i];
+		struct uvc_control *ctrl;
+
+		if (!(cfg->processing.bmControls & (1U << info->bit)))
+			continue;
+
+		ctrl = &controls->controls[controls->num_controls++];
+		ctrl->info = info;
+		ctrl->min = info->min;
+		ctrl->max = info->max;
+		ctrl->res = 1;
+		ctrl->def = info->def;
+		ctrl->cur = info->def;
+
+		controls->selectors[info->selector] = ctrl;
+	}
+
+	controls->timer = timer_new();
+	if (!controls->timer)
+		goto error;
+
+	ret = events_add_timer(events, controls->timer, uvc_controls_flush,
+			       controls);
+	if (ret < 0)
+		goto error;
+
+	controls->timer_watch = ret;
+
+	return controls;
+
+error:
+	if (controls->timer)
+		timer_destroy(controls->timer);
+	free(controls);
+	return NULL;
+}
+
+void uvc_controls_delete(struct uvc_controls *controls)
+{
+	if (!controls)
+		return;
+
+	events_unwatch(controls->events, controls->timer_watch);
+	timer_destroy(controls->timer);
+	free(controls);
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC controls
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+
+#ifndef __CONTROLS_H__
+#define __CONTROLS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct events;
+struct uvc_controls;
+struct uvc_function_config_control;
+struct uvc_request_data;
+struct video_source;
+
+/*
+ * The control table holds the range, default and current value of each
+ * Processing Unit control advertised in the function configuration. Requests
+ * from the host are answered from the table without accessing the video
+ * source. Values set by the host are forwarded to the video source from the
+ * event loop, after a short delay that coalesces bursts of requests into a
+ * single update.
+ */
+
+struct uvc_controls *uvc_controls_new(const struct uvc_function_config_control *cfg,
+				      struct events *events);
+void uvc_controls_delete(struct uvc_controls *controls);
+
+/*
+ * uvc_controls_set_video_source - Set the video source the controls apply to
+ * @controls: the control table
+ * @src: the video source, may be NULL
+ *
+ * Query the control ranges from the video source. Controls not set by the host
+ * yet are initialized with the values of the video source, and the values of
+ * the other controls are applied to the video source.
+ */
+void uvc_controls_set_video_source(struct uvc_controls *controls,
+				   struct video_source *src);
+
+bool uvc_controls_has_unit(struct uvc_controls *controls, unsigned int unit);
+
+/*
+ * uvc_controls_request - Process a control request setup
+ * @controls: the control table
+ * @req: the request code
+ * @cs: the control selector
+ * @len: the request wLength
+ * @resp: the response
+ *
+ * Fill the @resp for GET requests. For SET_CUR, set the length of the data
+ * expected from the host, which is then passed to uvc_controls_set_cur().
+ *
+ * Return 0 on success, or a negative error code if the request isn't
+ * supported, in which case @resp isn't modified.
+ */
+int uvc_controls_request(struct uvc_controls *controls, uint8_t req,
+			 uint8_t cs, uint16_t len,
+			 struct uvc_request_data *resp);
+
+int uvc_controls_set_cur(struct uvc_controls *controls, uint8_t cs,
+			 const struct uvc_request_data *data);
+
+#endif /* __CONTROLS_H__ */
@@ -12,171 +12,1214 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 
 #include "events.h"
+#include "histogram.h"
 #include "list.h"
+#include "timer.h"
 #include "tools.h"
 
-#define SELECT_TIMEOUT		2000		/* in milliseconds */
+#define EPOLL_MAX_EVENTS	32
+#define EVENTS_POST_BUDGET	64
+#define EVENTS_DEFAULT_BUDGET	8
 
+/*
+ * Watch handles store the slot index in the low-order bits and the slot
+ * generation in the high-order bits, keeping the handle a positive integer.
+ */
+#define EVENTS_HANDLE_INDEX_BITS	16
+#define EVENTS_HANDLE_INDEX_MASK	((1U << EVENTS_HANDLE_INDEX_BITS) - 1)
+#define EVENTS_HANDLE_GEN_MASK		0x7fffU
+#define EVENTS_MAX_SLOTS		(1U << EVENTS_HANDLE_INDEX_BITS)
+
+/*
+ * struct event_fd - A watched file descriptor
+ * @list: Entry in the events list
+ * @retired_next: Next entry in the list of retired watches
+ * @handle: The watch handle
+ * @fd: The watched file descriptor
+ * @epoll_fd: The file descriptor registered with epoll, either @fd or a
+ *	duplicate of it when @fd is watched for multiple event types
+ * @type: The event type
+ * @priority: The dispatch priority
+ * @removed: True if the watch has been removed during dispatch and is waiting
+ *	to be retired
+ * @timer: The timer whose expirations are consumed before calling @callback,
+ *	NULL for plain file descriptor watches
+ * @callback: Callback function
+ * @priv: Private data passed to the callback
+ * @stats: Callback duration histogram (statistics builds only)
+ */
 struct event_fd {
 	struct list_entry list;
+	struct event_fd *retired_next;
+	int handle;
 
 	int fd;
+	int epoll_fd;
 	enum event_type type;
+	enum event_priority priority;
+	bool removed;
+	struct timer *timer;
 	void (*callback)(void *priv);
 	void *priv;
+
+#ifdef EVENTS_STATS
+	struct histogram *stats;
+#endif
 };
 
-void events_watch_fd(struct events *events, int fd, enum event_type type,
-		     void(*callback)(void *), void *priv)
+/*
+ * struct event_slot - Entry in the watch handle table
+ * @event: The watch, or NULL if the slot is free
+ * @generation: Generation counter, incremented every time the slot is released
+ *	to invalidate stale handles
+ * @next_free: Index of the next free slot when the slot is free, -1 if none
+ */
+struct event_slot {
+	struct event_fd *event;
+	unsigned int generation;
+	int next_free;
+};
+
+/*
+ * struct event_post - Work posted to the event loop
+ * @next: Next entry in the posted work queue
+ * @callback: Callback function
+ * @priv: Private data passed to the callback
+ */
+struct event_post {
+	_Atomic(struct event_post *) next;
+	void (*callback)(void *priv);
+	void *priv;
+};
+
+/*
+ * struct event_post_queue - Multi-producer single-consumer posted work queue
+ * @head: Most recently posted entry, updated by producers
+ * @tail: Oldest entry, only accessed by the event loop thread
+ * @stub: Placeholder entry that keeps the queue non-empty
+ * @wakeup: True when the eventfd has been signalled and the event loop hasn't
+ *	started processing the queue yet
+ *
+ * This is an intrusive lock-free queue. Producers only need an atomic exchange
+ * to post work, and never wait for each other or for the consumer.
+ */
+struct event_post_queue {
+	_Atomic(struct event_post *) head;
+	struct event_post *tail;
+	struct event_post stub;
+	atomic_bool wakeup;
+};
+
+/*
+ * struct events_backend - Event wait backend operations
+ * @name: Backend name, for diagnostic purpose
+ * @watch: Start watching the file descriptor for an event
+ * @unwatch: Stop watching the file descriptor for an event
+ * @wait: Wait for events and dispatch them. Return 0 on success or a negative
+ *	error code otherwise
+ */
+struct events_backend {
+	const char *name;
+	int (*watch)(struct events *events, struct event_fd *event);
+	void (*unwatch)(struct events *events, struct event_fd *event);
+	int (*wait)(struct events *events);
+};
+
+/* -----------------------------------------------------------------------------
+ * Statistics
+ */
+
+#ifdef EVENTS_STATS
+
+/*
+ * struct events_loop_stats - Event loop instrumentation data
+ * @iterations: Number of event loop iterations
+ * @dispatches: Number of callbacks dispatched
+ * @wait_start: Time at which the event loop started waiting, in ns
+ * @wakeup: Time at which the event loop last woke up, in ns
+ * @wait: Wait duration histogram
+ * @delay: Wakeup-to-dispatch delay histogram
+ */
+struct events_loop_stats {
+	uint64_t iterations;
+	uint64_t dispatches;
+	uint64_t wait_start;
+	uint64_t wakeup;
+	struct histogram *wait;
+	struct histogram *delay;
+};
+
+static uint64_t events_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void events_stats_wait_begin(struct events *events)
+{
+	if (events->stats)
+		events->stats->wait_start = events_stats_clock();
+}
+
+static void events_stats_wait_end(struct events *events)
+{
+	struct events_loop_stats *stats = events->stats;
+
+	if (!stats)
+		return;
+
+	stats->wakeup = events_stats_clock();
+	stats->iterations++;
+	histogram_record(stats->wait, stats->wakeup - stats->wait_start);
+}
+
+static void events_stats_dispatch(struct events *events, struct event_fd *event)
+{
+	struct events_loop_stats *stats = events->stats;
+	uint64_t start;
+
+	if (!stats) {
+		event->callback(event->priv);
+		return;
+	}
+
+	start = events_stats_clock();
+	histogram_record(stats->delay, start - stats->wakeup);
+	stats->dispatches++;
+
+	/*
+	 * The event can't be freed by the callback, watches removed during
+	 * dispatch are only retired at the end of the iteration.
+	 */
+	event->callback(event->priv);
+
+	if (event->stats)
+		histogram_record(event->stats, events_stats_clock() - start);
+}
+
+static void events_stats_watch_init(struct event_fd *event)
+{
+	event->stats = histogram_new();
+}
+
+static void events_stats_watch_cleanup(struct event_fd *event)
+{
+	histogram_destroy(event->stats);
+}
+
+int events_get_stats(struct events *events, struct events_stats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+
+	if (!events->stats)
+		return -ENOMEM;
+
+	stats->iterations = events->stats->iterations;
+	stats->dispatches = events->stats->dispatches;
+	histogram_summarize(events->stats->wait, &stats->wait);
+	histogram_summarize(events->stats->delay, &stats->delay);
+
+	return 0;
+}
+
+int events_get_watch_stats(struct events *events,
+			   struct events_watch_stats *stats,
+			   unsigned int count)
 {
 	struct event_fd *event;
+	unsigned int num = 0;
 
-	event = malloc(sizeof *event);
-	if (event == NULL)
+	list_for_each_entry(event, &events->events, list) {
+		if (num < count) {
+			struct events_watch_stats *s = &stats[num];
+
+			memset(s, 0, sizeof *s);
+			s->handle = event->handle;
+			s->fd = event->fd;
+			s->type = event->type;
+			if (event->stats)
+				histogram_summarize(event->stats, &s->callback);
+		}
+
+		num++;
+	}
+
+	return num;
+}
+
+void events_reset_stats(struct events *events)
+{
+	struct event_fd *event;
+
+	if (!events->stats)
 		return;
 
-	event->fd = fd;
-	event->type = type;
-	event->callback = callback;
-	event->priv = priv;
+	events->stats->iterations = 0;
+	events->stats->dispatches = 0;
+	histogram_reset(events->stats->wait);
+	histogram_reset(events->stats->delay);
+
+	list_for_each_entry(event, &events->events, list) {
+		if (event->stats)
+			histogram_reset(event->stats);
+	}
+}
+
+static void events_stats_cleanup(struct events *events)
+{
+	if (!events->stats)
+		return;
+
+	histogram_destroy(events->stats->wait);
+	histogram_destroy(events->stats->delay);
+	free(events->stats);
+	events->stats = NULL;
+}
+
+static void events_stats_init(struct events *events)
+{
+	struct events_loop_stats *stats;
+
+	stats = calloc(1, sizeof *stats);
+	if (!stats)
+		return;
+
+	events->stats = stats;
+
+	stats->wait = histogram_new();
+	stats->delay = histogram_new();
+	if (!stats->wait || !stats->delay) {
+		printf("error: unable to allocate event loop statistics\n");
+		events_stats_cleanup(events);
+	}
+}
+
+#else /* EVENTS_STATS */
+
+static inline void events_stats_wait_begin(struct events *events __attribute__((unused)))
+{
+}
+
+static inline void events_stats_wait_end(struct events *events __attribute__((unused)))
+{
+}
+
+static inline void events_stats_dispatch(struct events *events __attribute__((unused)),
+					 struct event_fd *event)
+{
+	event->callback(event->priv);
+}
+
+static inline void events_stats_watch_init(struct event_fd *event __attribute__((unused)))
+{
+}
+
+static inline void events_stats_watch_cleanup(struct event_fd *event __attribute__((unused)))
+{
+}
+
+int events_get_stats(struct events *events __attribute__((unused)),
+		     struct events_stats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+	return -ENOTSUP;
+}
+
+int events_get_watch_stats(struct events *events __attribute__((unused)),
+			   struct events_watch_stats *stats __attribute__((unused)),
+			   unsigned int count __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
+void events_reset_stats(struct events *events __attribute__((unused)))
+{
+}
+
+static inline void events_stats_init(struct events *events __attribute__((unused)))
+{
+}
+
+static inline void events_stats_cleanup(struct events *events __attribute__((unused)))
+{
+}
+
+#endif /* EVENTS_STATS */
+
+/* -----------------------------------------------------------------------------
+ * Dispatch
+ */
+
+static void events_free_watch(struct event_fd *event)
+{
+	events_stats_watch_cleanup(event);
+	free(event);
+}
+
+static void events_dispatch_one(struct events *events, struct event_fd *event)
+{
+	/* Skip watches removed by a previous callback in this iteration. */
+	if (event->removed)
+		return;
+
+	/* Ignore spurious timer wakeups, the timer may have been re-armed. */
+	if (event->timer && !timer_expirations(event->timer))
+		return;
+
+	events_stats_dispatch(events, event);
+}
+
+/*
+ * Return true if the event can be dispatched in the current iteration, and
+ * charge it to the work budget.
+ */
+static bool events_charge(struct events *events, struct event_fd *event,
+			  unsigned int *spent)
+{
+	if (event->priority == EVENT_PRIORITY_HIGH || !events->budget)
+		return true;
+
+	if (*spent >= events->budget)
+		return false;
+
+	(*spent)++;
+	return true;
+}
+
+/* -----------------------------------------------------------------------------
+ * select() backend
+ */
+
+static int events_select_watch(struct events *events, struct event_fd *event)
+{
+	if (event->fd >= FD_SETSIZE)
+		return -EINVAL;
 
 	switch (event->type) {
 	case EVENT_READ:
-		FD_SET(fd, &events->rfds);
+		FD_SET(event->fd, &events->rfds);
 		break;
 	case EVENT_WRITE:
-		FD_SET(fd, &events->wfds);
+		FD_SET(event->fd, &events->wfds);
 		break;
 	case EVENT_EXCEPTION:
-		FD_SET(fd, &events->efds);
+		FD_SET(event->fd, &events->efds);
 		break;
 	}
 
-	events->maxfd = max(events->maxfd, fd);
+	events->maxfd = max(events->maxfd, event->fd);
 
-	list_append(&event->list, &events->events);
+	return 0;
 }
 
-void events_unwatch_fd(struct events *events, int fd, enum event_type type)
+static void events_select_unwatch(struct events *events,
+				  struct event_fd *event)
 {
-	struct event_fd *event = NULL;
-	struct event_fd *entry;
-	int maxfd = 0;
-
-	list_for_each_entry(entry, &events->events, list) {
-		if (entry->fd == fd && entry->type == type)
-			event = entry;
-		else
-			maxfd = max(maxfd, entry->fd);
-	}
-
-	if (event == NULL)
-		return;
-
+	/*
+	 * events->maxfd is only an upper bound, there's no need to lower it
+	 * and walk all watches.
+	 */
 	switch (event->type) {
 	case EVENT_READ:
-		FD_CLR(fd, &events->rfds);
+		FD_CLR(event->fd, &events->rfds);
 		break;
 	case EVENT_WRITE:
-		FD_CLR(fd, &events->wfds);
+		FD_CLR(event->fd, &events->wfds);
 		break;
 	case EVENT_EXCEPTION:
-		FD_CLR(fd, &events->efds);
+		FD_CLR(event->fd, &events->efds);
 		break;
 	}
+}
+
+static int events_select_wait(struct events *events)
+{
+	struct event_fd *event;
+	unsigned int spent = 0;
+	int priority;
+	fd_set rfds;
+	fd_set wfds;
+	fd_set efds;
+	int ret;
 
-	events->maxfd = maxfd;
+	rfds = events->rfds;
+	wfds = events->wfds;
+	efds = events->efds;
 
-	list_remove(&event->list);
-	free(event);
+	events_stats_wait_begin(events);
+	ret = select(events->maxfd + 1, &rfds, &wfds, &efds, NULL);
+	if (ret < 0)
+		return -errno;
+	events_stats_wait_end(events);
+
+	for (priority = EVENT_PRIORITY_HIGH; priority >= EVENT_PRIORITY_LOW;
+	     --priority) {
+		list_for_each_entry(event, &events->events, list) {
+			bool ready;
+
+			if ((int)event->priority != priority)
+				continue;
+
+			switch (event->type) {
+			case EVENT_READ:
+				ready = FD_ISSET(event->fd, &rfds);
+				break;
+			case EVENT_WRITE:
+				ready = FD_ISSET(event->fd, &wfds);
+				break;
+			case EVENT_EXCEPTION:
+			default:
+				ready = FD_ISSET(event->fd, &efds);
+				break;
+			}
+
+			if (!ready)
+				continue;
+
+			/*
+			 * Watches are level-triggered, the remaining ones will
+			 * be reported again in the next iteration.
+			 */
+			if (!events_charge(events, event, &spent))
+				return 0;
+
+			events_dispatch_one(events, event);
+
+			/* If the callback stopped events processing, we're done. */
+			if (events->done)
+				return 0;
+		}
+	}
+
+	return 0;
 }
 
-static void events_dispatch(struct events *events, const fd_set *rfds,
-			    const fd_set *wfds, const fd_set *efds)
+static const struct events_backend events_select_backend = {
+	.name = "select",
+	.watch = events_select_watch,
+	.unwatch = events_select_unwatch,
+	.wait = events_select_wait,
+};
+
+/* -----------------------------------------------------------------------------
+ * epoll backend
+ */
+
+static uint32_t events_epoll_mask(enum event_type type)
+{
+	switch (type) {
+	case EVENT_READ:
+		return EPOLLIN;
+	case EVENT_WRITE:
+		return EPOLLOUT;
+	case EVENT_EXCEPTION:
+	default:
+		/*
+		 * Unlike select(), epoll reports EPOLLERR regardless of the
+		 * requested events. V4L2 devices signal an error condition for
+		 * as long as their queue isn't streaming, which would make a
+		 * level-triggered exception watch spin. Use edge-triggered
+		 * mode instead, level-triggered behaviour is emulated by
+		 * events_epoll_dispatch_exception().
+		 */
+		return EPOLLPRI | EPOLLET;
+	}
+}
+
+static int events_epoll_watch(struct events *events, struct event_fd *event)
+{
+	struct epoll_event ev = {
+		.events = events_epoll_mask(event->type),
+		.data.ptr = event,
+	};
+	int ret;
+
+	event->epoll_fd = event->fd;
+
+	ret = epoll_ctl(events->epollfd, EPOLL_CTL_ADD, event->epoll_fd, &ev);
+	if (ret < 0 && errno == EEXIST) {
+		/*
+		 * epoll accepts a single registration per file descriptor.
+		 * When the same file descriptor is watched for another event
+		 * type, register a duplicate that refers to the same open file
+		 * instead.
+		 */
+		event->epoll_fd = fcntl(event->fd, F_DUPFD_CLOEXEC, 0);
+		if (event->epoll_fd < 0)
+			return -errno;
+
+		ret = epoll_ctl(events->epollfd, EPOLL_CTL_ADD, event->epoll_fd,
+				&ev);
+	}
+
+	if (ret < 0) {
+		ret = -errno;
+		if (event->epoll_fd != event->fd)
+			close(event->epoll_fd);
+		event->epoll_fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void events_epoll_unwatch(struct events *events,
+				 struct event_fd *event)
+{
+	if (event->epoll_fd < 0)
+		return;
+
+	epoll_ctl(events->epollfd, EPOLL_CTL_DEL, event->epoll_fd, NULL);
+
+	if (event->epoll_fd != event->fd)
+		close(event->epoll_fd);
+	event->epoll_fd = -1;
+}
+
+static void events_epoll_dispatch_exception(struct events *events,
+					    struct event_fd *event,
+					    uint32_t revents)
+{
+	struct pollfd pfd = {
+		.fd = event->epoll_fd,
+		.events = POLLPRI,
+	};
+
+	/* Error conditions alone are not reported to exception watches. */
+	if (!(revents & EPOLLPRI))
+		return;
+
+	/*
+	 * The watch is edge-triggered, keep dispatching until no exceptional
+	 * condition remains pending to match the select() semantics.
+	 */
+	do {
+		events_dispatch_one(events, event);
+
+		if (event->removed || events->done)
+			break;
+
+		if (poll(&pfd, 1, 0) <= 0)
+			break;
+	} while (pfd.revents & POLLPRI);
+}
+
+static int events_epoll_wait(struct events *events)
+{
+	struct epoll_event evs[EPOLL_MAX_EVENTS];
+	unsigned int spent = 0;
+	int priority;
+	int nevents;
+	int i;
+
+	events_stats_wait_begin(events);
+	nevents = epoll_wait(events->epollfd, evs, ARRAY_SIZE(evs), -1);
+	if (nevents < 0)
+		return -errno;
+	events_stats_wait_end(events);
+
+	/* Only the ready watches are touched. */
+	for (priority = EVENT_PRIORITY_HIGH; priority >= EVENT_PRIORITY_LOW;
+	     --priority) {
+		for (i = 0; i < nevents; ++i) {
+			struct event_fd *event = evs[i].data.ptr;
+
+			if ((int)event->priority != priority)
+				continue;
+
+			/*
+			 * Exception watches are edge-triggered and would not be
+			 * reported again if skipped, they're not subject to the
+			 * budget. Other watches are level-triggered, the
+			 * remaining ones will be reported again in the next
+			 * iteration. Keep scanning the batch once the budget
+			 * is spent, to dispatch the exception watches it holds.
+			 */
+			if (event->type == EVENT_EXCEPTION) {
+				events_epoll_dispatch_exception(events, event,
+								evs[i].events);
+			} else {
+				if (!events_charge(events, event, &spent))
+					continue;
+
+				events_dispatch_one(events, event);
+			}
+
+			/* If the callback stopped events processing, we're done. */
+			if (events->done)
+				return 0;
+		}
+	}
+
+	return 0;
+}
+
+static const struct events_backend events_epoll_backend = {
+	.name = "epoll",
+	.watch = events_epoll_watch,
+	.unwatch = events_epoll_unwatch,
+	.wait = events_epoll_wait,
+};
+
+/* -----------------------------------------------------------------------------
+ * Handle table
+ */
+
+static int events_slot_alloc(struct events *events, struct event_fd *event)
+{
+	struct event_slot *slot;
+	unsigned int index;
+
+	if (events->free_slot < 0) {
+		unsigned int num_slots = events->num_slots ? events->num_slots * 2 : 16;
+		struct event_slot *slots;
+		unsigned int i;
+
+		if (events->num_slots == EVENTS_MAX_SLOTS)
+			return -ENOSPC;
+
+		num_slots = min(num_slots, EVENTS_MAX_SLOTS);
+		slots = realloc(events->slots, num_slots * sizeof *slots);
+		if (!slots)
+			return -ENOMEM;
+
+		for (i = events->num_slots; i < num_slots; ++i) {
+			slots[i].event = NULL;
+			slots[i].generation = 1;
+			slots[i].next_free = i + 1 < num_slots ? (int)i + 1 : -1;
+		}
+
+		events->free_slot = events->num_slots;
+		events->slots = slots;
+		events->num_slots = num_slots;
+	}
+
+	index = events->free_slot;
+	slot = &events->slots[index];
+	events->free_slot = slot->next_free;
+
+	slot->event = event;
+	event->handle = (slot->generation << EVENTS_HANDLE_INDEX_BITS) | index;
+
+	return 0;
+}
+
+static struct event_fd *events_slot_lookup(struct events *events, int handle)
+{
+	unsigned int index = handle & EVENTS_HANDLE_INDEX_MASK;
+	unsigned int generation = (unsigned int)handle >> EVENTS_HANDLE_INDEX_BITS;
+
+	if (handle < 0 || index >= events->num_slots)
+		return NULL;
+
+	if (events->slots[index].generation != generation)
+		return NULL;
+
+	return events->slots[index].event;
+}
+
+static void events_slot_release(struct events *events, struct event_fd *event)
+{
+	unsigned int index = event->handle & EVENTS_HANDLE_INDEX_MASK;
+	struct event_slot *slot = &events->slots[index];
+
+	/* Bump the generation to invalidate the handle, skipping 0. */
+	slot->generation = (slot->generation + 1) & EVENTS_HANDLE_GEN_MASK;
+	if (!slot->generation)
+		slot->generation = 1;
+
+	slot->event = NULL;
+	slot->next_free = events->free_slot;
+	events->free_slot = index;
+}
+
+/* -----------------------------------------------------------------------------
+ * Watches
+ */
+
+static int events_watch(struct events *events, int fd, enum event_type type,
+			enum event_priority priority, struct timer *timer,
+			void(*callback)(void *), void *priv)
 {
 	struct event_fd *event;
+	int ret;
 
-	list_for_each_entry(event, &events->events, list) {
-		if (event->type == EVENT_READ &&
-		    FD_ISSET(event->fd, rfds))
-			event->callback(event->priv);
-		else if (event->type == EVENT_WRITE &&
-			 FD_ISSET(event->fd, wfds))
-			event->callback(event->priv);
-		else if (event->type == EVENT_EXCEPTION &&
-			 FD_ISSET(event->fd, efds))
-			event->callback(event->priv);
-
-		/* If the callback stopped events processing, we're done. */
-		if (events->done)
+	event = malloc(sizeof *event);
+	if (event == NULL)
+		return -ENOMEM;
+
+	memset(event, 0, sizeof *event);
+	event->fd = fd;
+	event->epoll_fd = -1;
+	event->type = type;
+	event->priority = priority;
+	event->timer = timer;
+	event->callback = callback;
+	event->priv = priv;
+	events_stats_watch_init(event);
+
+	ret = events_slot_alloc(events, event);
+	if (ret < 0)
+		goto error;
+
+	ret = events->backend->watch(events, event);
+	if (ret < 0) {
+		events_slot_release(events, event);
+		goto error;
+	}
+
+	list_append(&event->list, &events->events);
+
+	return event->handle;
+
+error:
+	printf("error: unable to watch fd %d with %s: %s (%d)\n", fd,
+	       events->backend->name, strerror(-ret), -ret);
+	events_free_watch(event);
+	return ret;
+}
+
+int events_watch_fd(struct events *events, int fd, enum event_type type,
+		    void(*callback)(void *), void *priv)
+{
+	return events_watch(events, fd, type, EVENT_PRIORITY_NORMAL, NULL,
+			    callback, priv);
+}
+
+int events_watch_fd_priority(struct events *events, int fd,
+			     enum event_type type,
+			     enum event_priority priority,
+			     void(*callback)(void *), void *priv)
+{
+	return events_watch(events, fd, type, priority, NULL, callback, priv);
+}
+
+int events_add_timer(struct events *events, struct timer *timer,
+		     void(*callback)(void *), void *priv)
+{
+	return events_watch(events, timer_fd(timer), EVENT_READ,
+			    EVENT_PRIORITY_NORMAL, timer, callback, priv);
+}
+
+void events_unwatch(struct events *events, int handle)
+{
+	struct event_fd *event;
+
+	event = events_slot_lookup(events, handle);
+	if (event == NULL)
+		return;
+
+	events->backend->unwatch(events, event);
+	events_slot_release(events, event);
+	list_remove(&event->list);
+
+	/*
+	 * The event may still be referenced by the dispatch loop, defer freeing
+	 * it until the end of the current iteration. The list entry pointers
+	 * are left untouched by list_remove(), an iteration currently
+	 * positioned on the event can thus safely proceed to the next entry.
+	 */
+	if (events->dispatching) {
+		event->removed = true;
+		event->retired_next = events->retired;
+		events->retired = event;
+		return;
+	}
+
+	events_free_watch(event);
+}
+
+/* -----------------------------------------------------------------------------
+ * Posted work
+ */
+
+static void event_post_queue_push(struct event_post_queue *queue,
+				  struct event_post *post)
+{
+	struct event_post *prev;
+
+	atomic_store_explicit(&post->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&queue->head, post,
+					memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, post, memory_order_release);
+}
+
+static struct event_post *
+event_post_queue_pop(struct event_post_queue *queue)
+{
+	struct event_post *tail = queue->tail;
+	struct event_post *next;
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &queue->stub) {
+		if (!next)
+			return NULL;
+
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	/*
+	 * A producer has swapped the head but not linked its entry yet. It will
+	 * signal the eventfd once done, retry on the next wakeup.
+	 */
+	if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+		return NULL;
+
+	/* Push the stub back to detach the last entry. */
+	event_post_queue_push(queue, &queue->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static void events_post_wakeup(struct events *events)
+{
+	uint64_t value = 1;
+
+	if (atomic_exchange(&events->posts->wakeup, true))
+		return;
+
+	if (write(events->postfd, &value, sizeof(value)) != sizeof(value))
+		printf("error: unable to wake up event loop (%d)\n", errno);
+}
+
+static void events_post_process(void *d)
+{
+	struct events *events = d;
+	struct event_post *post;
+	unsigned int count = 0;
+	uint64_t value;
+
+	if (read(events->postfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		return;
+
+	/*
+	 * Clear the wakeup flag before processing the queue, work posted from
+	 * now on will signal the eventfd again.
+	 */
+	atomic_store(&events->posts->wakeup, false);
+
+	while ((post = event_post_queue_pop(events->posts))) {
+		post->callback(post->priv);
+		free(post);
+
+		/*
+		 * Bound the amount of work processed in one go, callbacks may
+		 * post more work. Wake up the next iteration to resume.
+		 */
+		if (++count == EVENTS_POST_BUDGET) {
+			events_post_wakeup(events);
 			break;
+		}
 	}
 }
 
-bool events_loop(struct events *events)
+int events_post(struct events *events, void(*callback)(void *), void *priv)
 {
-	events->done = false;
+	struct event_post *post;
+
+	if (!events->posts)
+		return -ENODEV;
+
+	post = malloc(sizeof *post);
+	if (post == NULL)
+		return -ENOMEM;
+
+	post->callback = callback;
+	post->priv = priv;
+
+	event_post_queue_push(events->posts, post);
+	events_post_wakeup(events);
+
+	return 0;
+}
+
+static void events_post_cleanup(struct events *events)
+{
+	struct event_post *post;
+
+	if (!events->posts)
+		return;
+
+	while ((post = event_post_queue_pop(events->posts)))
+		free(post);
+
+	close(events->postfd);
+	events->postfd = -1;
+
+	free(events->posts);
+	events->posts = NULL;
+}
+
+static void events_post_init(struct events *events)
+{
+	struct event_post_queue *queue;
+
+	queue = malloc(sizeof *queue);
+	if (queue == NULL)
+		return;
+
+	events->postfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (events->postfd < 0) {
+		printf("error: unable to create eventfd (%d)\n", errno);
+		free(queue);
+		return;
+	}
+
+	atomic_init(&queue->stub.next, NULL);
+	atomic_init(&queue->head, &queue->stub);
+	atomic_init(&queue->wakeup, false);
+	queue->tail = &queue->stub;
+
+	events->posts = queue;
+
+	if (events_watch_fd(events, events->postfd, EVENT_READ,
+			    events_post_process, events) < 0)
+		events_post_cleanup(events);
+}
+
+/* -----------------------------------------------------------------------------
+ * Event loop
+ */
+
+static void events_retire(struct events *events)
+{
+	while (events->retired) {
+		struct event_fd *event = events->retired;
+
+		events->retired = event->retired_next;
+		events_free_watch(event);
+	}
+}
 
+static bool events_run(struct events *events)
+{
 	while (!events->done) {
-		fd_set rfds;
-		fd_set wfds;
-		fd_set efds;
 		int ret;
 
-		rfds = events->rfds;
-		wfds = events->wfds;
-		efds = events->efds;
+		events->dispatching = true;
+		ret = events->backend->wait(events);
+		events->dispatching = false;
+
+		if (events->retired)
+			events_retire(events);
 
-		ret = select(events->maxfd + 1, &rfds, &wfds, &efds, NULL);
 		if (ret < 0) {
 			/* EINTR means that a signal has been received, continue
 			 * to the next iteration in that case.
 			 */
-			if (errno == EINTR)
+			if (ret == -EINTR)
 				continue;
 
-			printf("error: select failed with %d\n", errno);
+			printf("error: %s failed with %d\n",
+			       events->backend->name, -ret);
 			break;
 		}
-
-		events_dispatch(events, &rfds, &wfds, &efds);
 	}
 
 	return !events->done;
 }
 
+bool events_loop(struct events *events)
+{
+	events->done = false;
+
+	return events_run(events);
+}
+
+static void *events_thread_main(void *arg)
+{
+	struct events *events = arg;
+
+	events_run(events);
+
+	return NULL;
+}
+
+int events_start_thread(struct events *events,
+			const struct events_thread_config *config)
+{
+	pthread_attr_t attr;
+	sigset_t sigmask;
+	sigset_t oldmask;
+	int ret;
+
+	if (events->threaded)
+		return -EBUSY;
+
+	ret = pthread_attr_init(&attr);
+	if (ret)
+		return -ret;
+
+	if (config && config->cpu >= 0) {
+		cpu_set_t cpus;
+
+		if (config->cpu >= CPU_SETSIZE) {
+			ret = EINVAL;
+			goto done;
+		}
+
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+
+		ret = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		if (ret)
+			goto done;
+	}
+
+	if (config && config->policy != SCHED_OTHER) {
+		struct sched_param param = {
+			.sched_priority = config->priority,
+		};
+
+		ret = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		if (!ret)
+			ret = pthread_attr_setschedpolicy(&attr, config->policy);
+		if (!ret)
+			ret = pthread_attr_setschedparam(&attr, &param);
+		if (ret)
+			goto done;
+	}
+
+	/*
+	 * Reset the done flag before creating the thread, an events_stop()
+	 * call racing with the thread startup must not be lost. The thread
+	 * inherits the signal mask, block all signals while creating it.
+	 */
+	events->done = false;
+
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_SETMASK, &sigmask, &oldmask);
+	ret = pthread_create(&events->thread, &attr, events_thread_main, events);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (!ret)
+		events->threaded = true;
+
+done:
+	pthread_attr_destroy(&attr);
+
+	if (ret)
+		printf("error: unable to start event loop thread: %s (%d)\n",
+		       strerror(ret), ret);
+
+	return -ret;
+}
+
+void events_stop_thread(struct events *events)
+{
+	if (!events->threaded)
+		return;
+
+	events_stop(events);
+	pthread_join(events->thread, NULL);
+	events->threaded = false;
+}
+
+void events_set_budget(struct events *events, unsigned int budget)
+{
+	events->budget = budget;
+}
+
 void events_stop(struct events *events)
 {
 	events->done = true;
+
+	/*
+	 * Wake up the event loop in case it's waiting in another thread. The
+	 * wakeup only uses a lock-free atomic operation and write(), making
+	 * this safe to call from signal handlers.
+	 */
+	if (events->posts)
+		events_post_wakeup(events);
 }
 
 void events_init(struct events *events)
 {
 	memset(events, 0, sizeof *events);
+	atomic_init(&events->done, false);
 
 	FD_ZERO(&events->rfds);
 	FD_ZERO(&events->wfds);
 	FD_ZERO(&events->efds);
 	events->maxfd = 0;
 	list_init(&events->events);
+	events->budget = EVENTS_DEFAULT_BUDGET;
+	events->free_slot = -1;
+
+	events->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (events->epollfd < 0) {
+		printf("warning: epoll unavailable (%d), falling back to select\n",
+		       errno);
+		events->backend = &events_select_backend;
+	} else {
+		events->backend = &events_epoll_backend;
+	}
+
+	events_stats_init(events);
+
+	events->postfd = -1;
+	events_post_init(events);
 }
 
 void events_cleanup(struct events *events)
 {
+	events_stop_thread(events);
+
 	while (!list_empty(&events->events)) {
 		struct event_fd *event;
 
 		event = list_first_entry(&events->events, typeof(*event), list);
+		events->backend->unwatch(events, event);
 		list_remove(&event->list);
-		free(event);
+		events_free_watch(event);
+	}
+
+	free(events->slots);
+	events->slots = NULL;
+	events->num_slots = 0;
+	events->free_slot = -1;
+
+	events_post_cleanup(events);
+	events_stats_cleanup(events);
+
+	if (events->epollfd >= 0) {
+		close(events->epollfd);
+		events->epollfd = -1;
 	}
 }
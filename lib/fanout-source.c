@@ -0,0 +1,437 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Fan-out video source
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "fanout-source.h"
+#include "tools.h"
+#include "video-buffers.h"
+
+#define FANOUT_MAX_TAPS		32
+
+struct fanout_tap {
+	struct video_source src;
+
+	struct fanout_source *fanout;
+	unsigned int id;
+	bool allocated;
+	bool streaming;
+};
+
+#define to_fanout_tap(s) container_of(s, struct fanout_tap, src)
+
+/*
+ * struct fanout_source - Fan-out of a video source to multiple taps
+ * @upstream: The upstream video source
+ * @taps: The taps, indexed by tap ID
+ * @format: The format set on the upstream source
+ * @users: Number of taps with allocated buffers
+ * @streaming: Number of streaming taps
+ * @buffers: Buffers exported by the upstream source
+ * @holders: Bitmask of the taps holding each buffer
+ */
+struct fanout_source {
+	struct video_source *upstream;
+	struct fanout_tap *taps[FANOUT_MAX_TAPS];
+
+	struct v4l2_pix_format format;
+	unsigned int users;
+	unsigned int streaming;
+
+	struct video_buffer_set *buffers;
+	uint32_t *holders;
+};
+
+/* -----------------------------------------------------------------------------
+ * Buffer reference counting
+ */
+
+static void fanout_source_release(struct fanout_source *fanout,
+				  unsigned int index, unsigned int id)
+{
+	struct video_buffer buf;
+
+	if (!(fanout->holders[index] & (1U << id)))
+		return;
+
+	fanout->holders[index] &= ~(1U << id);
+	if (fanout->holders[index])
+		return;
+
+	/* The last tap has released the buffer, capture a new frame in it. */
+	buf = fanout->buffers->buffers[index];
+	buf.index = index;
+	video_source_queue_buffer(fanout->upstream, &buf);
+}
+
+static void fanout_source_process(void *d, struct video_source *upstream,
+				  struct video_buffer *buffer)
+{
+	struct fanout_source *fanout = d;
+	uint32_t holders = 0;
+	unsigned int i;
+
+	if (!fanout->holders || buffer->index >= fanout->buffers->nbufs) {
+		video_source_queue_buffer(upstream, buffer);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fanout->taps); ++i) {
+		if (fanout->taps[i] && fanout->taps[i]->streaming)
+			holders |= 1U << i;
+	}
+
+	if (!holders) {
+		video_source_queue_buffer(upstream, buffer);
+		return;
+	}
+
+	/*
+	 * Take all references before handing the buffer to the taps, as they
+	 * may release it synchronously.
+	 */
+	fanout->holders[buffer->index] = holders;
+
+	for (i = 0; i < ARRAY_SIZE(fanout->taps); ++i) {
+		struct fanout_tap *tap = fanout->taps[i];
+		struct video_buffer buf = *buffer;
+
+		if (!(holders & (1U << i)))
+			continue;
+
+		tap->src.handler(tap->src.handler_data, &tap->src, &buf);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Tap operations
+ */
+
+static int fanout_tap_stream_off(struct video_source *s);
+static int fanout_tap_free_buffers(struct video_source *s);
+
+static void fanout_tap_destroy(struct video_source *s)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	fanout_tap_stream_off(s);
+	fanout_tap_free_buffers(s);
+
+	tap->fanout->taps[tap->id] = NULL;
+	free(tap);
+}
+
+static int fanout_tap_set_format(struct video_source *s,
+				 struct v4l2_pix_format *fmt)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+	int ret;
+
+	/*
+	 * The format can't be changed while another tap uses the buffers. Taps
+	 * requesting the current format share them.
+	 */
+	if (fanout->users && !(tap->allocated && fanout->users == 1)) {
+		if (fmt->pixelformat != fanout->format.pixelformat ||
+		    fmt->width != fanout->format.width ||
+		    fmt->height != fanout->format.height) {
+			printf("Fan-out format mismatch, 0x%08x %ux%u in use\n",
+			       fanout->format.pixelformat,
+			       fanout->format.width, fanout->format.height);
+			return -EBUSY;
+		}
+
+		*fmt = fanout->format;
+		return 0;
+	}
+
+	ret = video_source_set_format(fanout->upstream, fmt);
+	if (ret < 0)
+		return ret;
+
+	fanout->format = *fmt;
+	return 0;
+}
+
+static int fanout_tap_set_frame_interval(struct video_source *s,
+					 unsigned int interval)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	return video_source_set_frame_interval(tap->fanout->upstream, interval);
+}
+
+static int fanout_tap_alloc_buffers(struct video_source *s, unsigned int nbufs)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+	int ret;
+
+	if (tap->allocated)
+		return 0;
+
+	/* The first tap sets the number of buffers. */
+	if (!fanout->users) {
+		ret = video_source_alloc_buffers(fanout->upstream, nbufs);
+		if (ret < 0)
+			return ret;
+	}
+
+	fanout->users++;
+	tap->allocated = true;
+
+	return 0;
+}
+
+static int fanout_tap_export_buffers(struct video_source *s,
+				     struct video_buffer_set **bufs)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+	struct video_buffer_set *buffers;
+	unsigned int i;
+	int ret;
+
+	if (!tap->allocated)
+		return -EINVAL;
+
+	/* Export the upstream buffers once, and share them between all taps. */
+	if (!fanout->buffers) {
+		ret = video_source_export_buffers(fanout->upstream,
+						  &fanout->buffers);
+		if (ret < 0)
+			return ret;
+
+		fanout->holders = calloc(fanout->buffers->nbufs,
+					 sizeof(*fanout->holders));
+		if (!fanout->holders) {
+			video_buffer_set_delete(fanout->buffers);
+			fanout->buffers = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	buffers = video_buffer_set_new(fanout->buffers->nbufs);
+	if (!buffers)
+		return -ENOMEM;
+
+	for (i = 0; i < buffers->nbufs; ++i) {
+		buffers->buffers[i] = fanout->buffers->buffers[i];
+		buffers->buffers[i].index = i;
+	}
+
+	*bufs = buffers;
+	return 0;
+}
+
+static int fanout_tap_free_buffers(struct video_source *s)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+
+	if (!tap->allocated)
+		return 0;
+
+	tap->allocated = false;
+	if (--fanout->users)
+		return 0;
+
+	video_buffer_set_delete(fanout->buffers);
+	fanout->buffers = NULL;
+	free(fanout->holders);
+	fanout->holders = NULL;
+
+	return video_source_free_buffers(fanout->upstream);
+}
+
+static int fanout_tap_stream_on(struct video_source *s)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+	int ret;
+
+	if (tap->streaming)
+		return 0;
+
+	/* The upstream source queues all its buffers when started. */
+	if (!fanout->streaming) {
+		ret = video_source_stream_on(fanout->upstream);
+		if (ret < 0)
+			return ret;
+	}
+
+	fanout->streaming++;
+	tap->streaming = true;
+
+	return 0;
+}
+
+static int fanout_tap_stream_off(struct video_source *s)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+	unsigned int i;
+
+	if (!tap->streaming)
+		return 0;
+
+	tap->streaming = false;
+
+	/* Stopping the upstream source reclaims all buffers. */
+	if (!--fanout->streaming) {
+		if (fanout->holders)
+			memset(fanout->holders, 0, fanout->buffers->nbufs *
+			       sizeof(*fanout->holders));
+
+		return video_source_stream_off(fanout->upstream);
+	}
+
+	/*
+	 * The buffers held by the tap have been reclaimed from its sink, drop
+	 * their references.
+	 */
+	for (i = 0; fanout->holders && i < fanout->buffers->nbufs; ++i)
+		fanout_source_release(fanout, i, tap->id);
+
+	return 0;
+}
+
+static int fanout_tap_queue_buffer(struct video_source *s,
+				   struct video_buffer *buf)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+	struct fanout_source *fanout = tap->fanout;
+
+	if (!fanout->holders || buf->index >= fanout->buffers->nbufs)
+		return -EINVAL;
+
+	if (tap->streaming)
+		fanout_source_release(fanout, buf->index, tap->id);
+
+	return 0;
+}
+
+/*
+ * Controls apply to the upstream source, and are thus shared by all taps. The
+ * last value set by any tap wins.
+ */
+static int fanout_tap_query_control(struct video_source *s,
+				    struct v4l2_queryctrl *query)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	return video_source_query_control(tap->fanout->upstream, query);
+}
+
+static int fanout_tap_get_controls(struct video_source *s, unsigned int count,
+				   struct v4l2_ext_control *ctrls)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	return video_source_get_controls(tap->fanout->upstream, count, ctrls);
+}
+
+static int fanout_tap_set_controls(struct video_source *s, unsigned int count,
+				   struct v4l2_ext_control *ctrls)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	return video_source_set_controls(tap->fanout->upstream, count, ctrls);
+}
+
+static const struct video_source_ops fanout_tap_ops = {
+	.destroy = fanout_tap_destroy,
+	.set_format = fanout_tap_set_format,
+	.set_frame_interval = fanout_tap_set_frame_interval,
+	.alloc_buffers = fanout_tap_alloc_buffers,
+	.export_buffers = fanout_tap_export_buffers,
+	.free_buffers = fanout_tap_free_buffers,
+	.stream_on = fanout_tap_stream_on,
+	.stream_off = fanout_tap_stream_off,
+	.queue_buffer = fanout_tap_queue_buffer,
+	.query_control = fanout_tap_query_control,
+	.get_controls = fanout_tap_get_controls,
+	.set_controls = fanout_tap_set_controls,
+};
+
+struct video_source *fanout_video_source_create(struct fanout_source *fanout)
+{
+	struct fanout_tap *tap;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(fanout->taps); ++i) {
+		if (!fanout->taps[i])
+			break;
+	}
+
+	if (i == ARRAY_SIZE(fanout->taps)) {
+		printf("Too many fan-out taps\n");
+		return NULL;
+	}
+
+	tap = malloc(sizeof *tap);
+	if (!tap)
+		return NULL;
+
+	memset(tap, 0, sizeof *tap);
+	tap->src.ops = &fanout_tap_ops;
+	tap->fanout = fanout;
+	tap->id = i;
+
+	fanout->taps[i] = tap;
+
+	return &tap->src;
+}
+
+void fanout_video_source_init(struct video_source *s, struct events *events)
+{
+	struct fanout_tap *tap = to_fanout_tap(s);
+
+	tap->src.events = events;
+}
+
+/* -----------------------------------------------------------------------------
+ * Fan-out source
+ */
+
+struct fanout_source *fanout_source_create(struct video_source *upstream)
+{
+	struct fanout_source *fanout;
+
+	if (!upstream->ops->alloc_buffers || !upstream->ops->export_buffers) {
+		printf("Fan-out requires a source that allocates buffers\n");
+		return NULL;
+	}
+
+	fanout = malloc(sizeof *fanout);
+	if (!fanout)
+		return NULL;
+
+	memset(fanout, 0, sizeof *fanout);
+	fanout->upstream = upstream;
+
+	video_source_set_buffer_handler(upstream, fanout_source_process, fanout);
+
+	return fanout;
+}
+
+void fanout_source_destroy(struct fanout_source *fanout)
+{
+	if (!fanout)
+		return;
+
+	video_buffer_set_delete(fanout->buffers);
+	free(fanout->holders);
+	video_source_destroy(fanout->upstream);
+	free(fanout);
+}
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Latency histograms
+ *
+ * Copyright (C) 2026 The uvcgadget contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "tools.h"
+
+/*
+ * Values smaller than 2^HISTOGRAM_SUB_BITS have a bucket each. Larger values
+ * are split in buckets by their most significant bit, and each power of two is
+ * split in 2^HISTOGRAM_SUB_BITS linear sub-buckets.
+ */
+#define HISTOGRAM_SUB_BITS	3
+#define HISTOGRAM_SUB_BUCKETS	(1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS	40
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+static unsigned int histogram_bucket(uint64_t value)
+{
+	unsigned int msb;
+	unsigned int sub;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+
+	sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+	return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t histogram_bucket_upper(unsigned int index)
+{
+	unsigned int msb;
+	unsigned int sub;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	msb = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	sub = index % HISTOGRAM_SUB_BUCKETS;
+
+	return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1)
+		<< (msb - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+struct histogram *histogram_new(void)
+{
+	struct histogram *hist;
+
+	hist = malloc(sizeof *hist);
+	if (!hist)
+		return NULL;
+
+	histogram_reset(hist);
+
+	return hist;
+}
+
+void histogram_destroy(struct histogram *hist)
+{
+	free(hist);
+}
+
+void histogram_record(struct histogram *hist, uint64_t value)
+{
+	hist->buckets[histogram_bucket(value)]++;
+	hist->count++;
+	hist->sum += value;
+
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void histogram_reset(struct histogram *hist)
+{
+	memset(hist, 0, sizeof *hist);
+	hist->min = UINT64_MAX;
+}
+
+uint64_t histogram_percentile(const struct histogram *hist,
+			      unsigned int permille)
+{
+	uint64_t threshold;
+	uint64_t total = 0;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	threshold = div_round_up(hist->count * min(permille, 1000U), 1000);
+	if (!threshold)
+		threshold = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		total += hist->buckets[i];
+		if (total >= threshold)
+			break;
+	}
+
+	return clamp(histogram_bucket_upper(i), hist->min, hist->max);
+}
+
+void histogram_summarize(const struct histogram *hist,
+			 struct histogram_summary *summary)
+{
+	memset(summary, 0, sizeof *summary);
+
+	if (!hist->count)
+		return;
+
+	summary->count = hist->count;
+	summary->min = hist->min;
+	summary->max = hist->max;
+	summary->mean = hist->sum / hist->count;
+	summary->p50 = histogram_percentile(hist, 500);
+	summary->p90 = histogram_percentile(hist, 900);
+	summary->p99 = histogram_percentile(hist, 990);
+}
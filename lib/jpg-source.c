@@ -29,11 +29,13 @@
 struct jpg_source {
 	struct video_source src;
 
+	char *img_path;
 	unsigned int imgsize;
 	void *imgdata;
 
 	struct timer *timer;
-	bool streaming;
+	int timer_watch;
+	struct video_buffer_queue buffers;
 };
 
 #define to_jpg_source(s) container_of(s, struct jpg_source, src)
@@ -45,27 +47,35 @@ static void jpg_source_destroy(struct video_source *s)
 	if (src->imgdata)
 		free(src->imgdata);
 
+	free(src->img_path);
+
 	timer_destroy(src->timer);
 
 	free(src);
 }
 
-static int jpg_source_set_format(struct video_source *s __attribute__((unused)),
+static int jpg_source_set_format(struct video_source *s,
 				  struct v4l2_pix_format *fmt)
 {
+	struct jpg_source *src = to_jpg_source(s);
+
 	if (fmt->pixelformat != v4l2_fourcc('M', 'J', 'P', 'G')) {
 		printf("jpg-source: unsupported fourcc\n");
 		return -EINVAL;
 	}
 
+	/* All frames are the same image. */
+	fmt->sizeimage = src->imgsize;
+
 	return 0;
 }
 
-static int jpg_source_set_frame_rate(struct video_source *s, unsigned int fps)
+static int jpg_source_set_frame_interval(struct video_source *s,
+					 unsigned int interval)
 {
 	struct jpg_source *src = to_jpg_source(s);
 
-	timer_set_fps(src->timer, fps);
+	timer_set_interval(src->timer, interval * 100ULL);
 
 	return 0;
 }
@@ -75,16 +85,57 @@ static int jpg_source_free_buffers(struct video_source *s __attribute__((unused)
 	return 0;
 }
 
+static void jpg_source_fill_buffer(struct video_source *s,
+				   struct video_buffer *buf)
+{
+	struct jpg_source *src = to_jpg_source(s);
+
+	/* A reloaded image may not fit in buffers sized for the previous one. */
+	if (src->imgsize > buf->size) {
+		buf->bytesused = 0;
+		buf->error = true;
+		return;
+	}
+
+	memcpy(buf->mem, src->imgdata, src->imgsize);
+	buf->bytesused = src->imgsize;
+}
+
+static void jpg_source_timer_expired(void *d)
+{
+	struct jpg_source *src = d;
+	struct video_buffer buf;
+
+	/*
+	 * Produce a frame at every timer period to ensure that our configured
+	 * frame rate is adhered to. If all buffers are queued to the sink the
+	 * frame is skipped.
+	 */
+	if (!video_buffer_queue_pop(&src->buffers, &buf))
+		return;
+
+	jpg_source_fill_buffer(&src->src, &buf);
+	src->src.handler(src->src.handler_data, &src->src, &buf);
+}
+
 static int jpg_source_stream_on(struct video_source *s)
 {
 	struct jpg_source *src = to_jpg_source(s);
 	int ret;
 
+	ret = events_add_timer(src->src.events, src->timer,
+			       jpg_source_timer_expired, src);
+	if (ret < 0)
+		return ret;
+
+	src->timer_watch = ret;
+
 	ret = timer_arm(src->timer);
-	if (ret)
+	if (ret) {
+		events_unwatch(src->src.events, src->timer_watch);
 		return ret;
+	}
 
-	src->streaming = true;
 	return 0;
 }
 
@@ -98,45 +149,88 @@ static int jpg_source_stream_off(struct video_source *s)
 	 * even if the timer is still running due to the failure.
 	 */
 	ret = timer_disarm(src->timer);
-	src->streaming = false;
+	events_unwatch(src->src.events, src->timer_watch);
+
+	/* The sink owns all buffers again once streaming is stopped. */
+	video_buffer_queue_init(&src->buffers);
 
 	return ret;
 }
 
-static void jpg_source_fill_buffer(struct video_source *s,
+static int jpg_source_queue_buffer(struct video_source *s,
 				   struct video_buffer *buf)
 {
 	struct jpg_source *src = to_jpg_source(s);
 
-	memcpy(buf->mem, src->imgdata, src->imgsize);
-	buf->bytesused = src->imgsize;
+	return video_buffer_queue_push(&src->buffers, buf);
+}
 
-	/*
-	 * Wait for the timer to elapse to ensure that our configured frame rate
-	 * is adhered to.
-	 */
-	if (src->streaming)
-		timer_wait(src->timer);
+static int jpg_source_load(struct jpg_source *src)
+{
+	unsigned int imgsize;
+	void *imgdata;
+	int fd;
+	int ret;
+
+	fd = open(src->img_path, O_RDONLY);
+	if (fd == -1) {
+		printf("Unable to open MJPEG image '%s'\n", src->img_path);
+		return -errno;
+	}
+
+	imgsize = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	imgdata = malloc(imgsize);
+	if (imgdata == NULL) {
+		printf("Unable to allocate memory for MJPEG image\n");
+		close(fd);
+		return -ENOMEM;
+	}
+
+	ret = read(fd, imgdata, imgsize);
+	if (ret < 0) {
+		ret = -errno;
+		fprintf(stderr, "error reading data from %s: %d\n",
+			src->img_path, -ret);
+		free(imgdata);
+		close(fd);
+		return ret;
+	}
+
+	close(fd);
+
+	/* Replace the current image only once the new one has been read. */
+	free(src->imgdata);
+	src->imgdata = imgdata;
+	src->imgsize = imgsize;
+
+	return 0;
+}
+
+static int jpg_source_reload(struct video_source *s)
+{
+	struct jpg_source *src = to_jpg_source(s);
+
+	return jpg_source_load(src);
 }
 
 static const struct video_source_ops jpg_source_ops = {
 	.destroy = jpg_source_destroy,
 	.set_format = jpg_source_set_format,
-	.set_frame_rate = jpg_source_set_frame_rate,
+	.set_frame_interval = jpg_source_set_frame_interval,
 	.alloc_buffers = NULL,
 	.export_buffers = NULL,
 	.free_buffers = jpg_source_free_buffers,
 	.stream_on = jpg_source_stream_on,
 	.stream_off = jpg_source_stream_off,
-	.queue_buffer = NULL,
+	.queue_buffer = jpg_source_queue_buffer,
 	.fill_buffer = jpg_source_fill_buffer,
+	.reload = jpg_source_reload,
 };
 
 struct video_source *jpg_video_source_create(const char *img_path)
 {
 	struct jpg_source *src;
-	int fd = -1;
-	int ret;
 
 	printf("using jpg video source\n");
 
@@ -150,38 +244,25 @@ struct video_source *jpg_video_source_create(const char *img_path)
 	memset(src, 0, sizeof *src);
 	src->src.ops = &jpg_source_ops;
 
-	fd = open(img_path, O_RDONLY);
-	if (fd == -1) {
-		printf("Unable to open MJPEG image '%s'\n", img_path);
+	src->img_path = strdup(img_path);
+	if (!src->img_path)
 		goto err_free_src;
-	}
 
-	src->imgsize = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
-	src->imgdata = malloc(src->imgsize);
-	if (src->imgdata == NULL) {
-		printf("Unable to allocate memory for MJPEG image\n");
-		goto err_close_fd;
-	}
-
-	ret = read(fd, src->imgdata, src->imgsize);
-	if (ret < 0) {
-		fprintf(stderr, "error reading data from %s: %d\n", img_path, errno);
-		goto err_free_imgdata;
-	}
+	if (jpg_source_load(src) < 0)
+		goto err_free_path;
 
 	src->timer = timer_new();
 	if (!src->timer)
 		goto err_free_imgdata;
 
-	close(fd);
+	video_buffer_queue_init(&src->buffers);
 
 	return &src->src;
 
 err_free_imgdata:
 	free(src->imgdata);
-err_close_fd:
-	close(fd);
+err_free_path:
+	free(src->img_path);
 err_free_src:
 	free(src);
 
@@ -39,26 +39,34 @@ struct slideshow_source {
 	struct video_source src;
 
 	char img_dir[NAME_MAX];
+	struct v4l2_pix_format fmt;
 
 	struct slide *cur_slide;
 	struct list_entry slides;
 
 	struct timer *timer;
-	bool streaming;
+	int timer_watch;
+	struct video_buffer_queue buffers;
 };
 
 #define to_slideshow_source(s) container_of(s, struct slideshow_source, src)
 
-static void slideshow_source_destroy(struct video_source *s)
+static void slideshow_source_free_slides(struct list_entry *slides)
 {
-	struct slideshow_source *src = to_slideshow_source(s);
 	struct slide *slide, *next;
 
-	list_for_each_entry_safe(slide, next, &src->slides, list) {
+	list_for_each_entry_safe(slide, next, slides, list) {
 		list_remove(&slide->list);
 		free(slide->imgdata);
 		free(slide);
 	}
+}
+
+static void slideshow_source_destroy(struct video_source *s)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+
+	slideshow_source_free_slides(&src->slides);
 	timer_destroy(src->timer);
 	free(src);
 }
@@ -81,88 +89,36 @@ char *v4l2_fourcc2s(__u32 fourcc, char *buf)
 }
 
 /*
- * slideshow_source_set_format - set the V4L2 format
- *
- * For this source, we require images stored in a directory structure with nodes
- * for each format and framesize, for example:
+ * slideshow_source_load_slides - load the slides for a V4L2 format
  *
- * slideshow +
- *	     |
- *	     + MJPG +
- *	     |      |
- *	     |      + 1280x720  +
- *	     |      |           |
- *	     |      |           + 01.jpg
- *	     |      |           |
- *	     |      |           + 02.jpg
- *	     |      |           |
- *	     |      |           + 03.jpg
- *	     |      |
- *	     |      + 1920x1080
- *	     |
- *	     + YUYV +
- *		    |
- *		    + 1280x720
- *		    |
- *		    + 1920x1080
- *
- * The root directory will be passed as an argument to slideshow_source_create()
- * and so is not fixed, but the second level directories must be named with the
- * fourcc of the format the images within represent, and the third level's node
- * names must be in the format "<width>x<height>".
+ * Load all images for the format @fmt in the @slides list. On failure the
+ * @slides list is left empty.
  */
-static int slideshow_source_set_format(struct video_source *s,
-				       struct v4l2_pix_format *fmt)
+static int slideshow_source_load_slides(struct slideshow_source *src,
+					const struct v4l2_pix_format *fmt,
+					struct list_entry *slides)
 {
-	struct slideshow_source *src = to_slideshow_source(s);
 	char dirname[PATH_MAX];
-	struct slide *slide, *next;
+	struct slide *slide;
 	struct dirent *file;
 	char fourcc_buf[8];
 	int fd = -1;
-	char *cwd;
 	DIR *dir;
 	int ret;
 
-	/*
-	 * If the format is changed, we need to clear the existing list of
-	 * slides before adding new ones.
-	 */
-	list_for_each_entry_safe(slide, next, &src->slides, list) {
-		list_remove(&slide->list);
-		free(slide->imgdata);
-		free(slide);
-	}
-
 	ret = snprintf(dirname, sizeof(dirname), "%s/%s/%ux%u", src->img_dir,
 		       v4l2_fourcc2s(fmt->pixelformat, fourcc_buf),
 		       fmt->width, fmt->height);
 	if (ret < 0) {
 		fprintf(stderr, "failed to store directory name: %s (%d)\n",
 			strerror(ret), ret);
-		ret = errno;
-		goto err_dummy_slide;
+		return -errno;
 	}
 
 	dir = opendir(dirname);
 	if (!dir) {
 		fprintf(stderr, "unable to find directory %s\n", dirname);
-		ret = -ENOENT;
-		goto err_dummy_slide;
-	}
-
-	cwd = getcwd(NULL, 0);
-	if (!cwd) {
-		fprintf(stderr, "unable to allocate memory for cwd name\n");
-		ret = -ENOMEM;
-		goto err_dummy_slide;
-	}
-
-	ret = chdir(dirname);
-	if (ret) {
-		fprintf(stderr, "unable to cd to directory '%s': %s (%d)\n",
-			dirname, strerror(ret), ret);
-		goto err_close_dir;
+		return -ENOENT;
 	}
 
 	while ((file = readdir(dir))) {
@@ -170,11 +126,15 @@ static int slideshow_source_set_format(struct video_source *s,
 		    !strcmp(file->d_name, ".."))
 			continue;
 
-		fd = open(file->d_name, O_RDONLY);
+		/*
+		 * Open the files relative to the directory instead of changing
+		 * the working directory, which is shared by all threads.
+		 */
+		fd = openat(dirfd(dir), file->d_name, O_RDONLY);
 		if (fd == -1) {
 			fprintf(stderr, "Unable to open file '%s/%s'\n", dirname,
 				file->d_name);
-			ret = errno;
+			ret = -errno;
 			goto err_unwind;
 		}
 
@@ -199,31 +159,21 @@ static int slideshow_source_set_format(struct video_source *s,
 		if (ret < 0) {
 			fprintf(stderr, "failed to read from %s/%s: %u\n",
 				dirname, file->d_name, errno);
-			ret = errno;
+			ret = -errno;
 			goto err_free_imgdata;
 		}
 
-		list_append(&slide->list, &src->slides);
+		list_append(&slide->list, slides);
 		close(fd);
 	}
 
-	if (list_empty(&src->slides)) {
-		fprintf(stderr, "failed to find any images in %s\n", dirname);
-		ret = -ENOENT;
-		goto err_free_cwd;
-	}
+	closedir(dir);
 
-	ret = chdir(cwd);
-	if (ret) {
-		fprintf(stderr, "unable to cd to directory '%s': %s (%d)\n",
-			cwd, strerror(ret), ret);
-		goto err_free_cwd;
+	if (list_empty(slides)) {
+		fprintf(stderr, "failed to find any images in %s\n", dirname);
+		return -ENOENT;
 	}
 
-	free(cwd);
-	closedir(dir);
-	src->cur_slide = list_first_entry(&src->slides, struct slide, list);
-
 	return 0;
 
 err_free_imgdata:
@@ -233,17 +183,71 @@ err_free_slide:
 err_close_fd:
 	close(fd);
 err_unwind:
-	list_for_each_entry_safe(slide, next, &src->slides, list) {
-		list_remove(&slide->list);
-		free(slide->imgdata);
-		free(slide);
-	}
-err_free_cwd:
-	chdir(cwd);
-	free(cwd);
-err_close_dir:
+	slideshow_source_free_slides(slides);
 	closedir(dir);
-err_dummy_slide:
+	return ret;
+}
+/*
+ * slideshow_source_set_format - set the V4L2 format
+ *
+ * For this source, we require images stored in a directory structure with nodes
+ * for each format and framesize, for example:
+ *
+ * slideshow +
+ *	     |
+ *	     + MJPG +
+ *	     |      |
+ *	     |      + 1280x720  +
+ *	     |      |           |
+ *	     |      |           + 01.jpg
+ *	     |      |           |
+ *	     |      |           + 02.jpg
+ *	     |      |           |
+ *	     |      |           + 03.jpg
+ *	     |      |
+ *	     |      + 1920x1080
+ *	     |
+ *	     + YUYV +
+ *		    |
+ *		    + 1280x720
+ *		    |
+ *		    + 1920x1080
+ *
+ * The root directory will be passed as an argument to slideshow_source_create()
+ * and so is not fixed, but the second level directories must be named with the
+ * fourcc of the format the images within represent, and the third level's node
+ * names must be in the format "<width>x<height>".
+ */
+static int slideshow_source_set_format(struct video_source *s,
+				       struct v4l2_pix_format *fmt)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+	struct slide *slide;
+	int ret;
+
+	/*
+	 * If the format is changed, we need to clear the existing list of
+	 * slides before adding new ones.
+	 */
+	slideshow_source_free_slides(&src->slides);
+
+	src->fmt = *fmt;
+
+	ret = slideshow_source_load_slides(src, fmt, &src->slides);
+	if (!ret) {
+		src->cur_slide = list_first_entry(&src->slides, struct slide,
+						  list);
+
+		/* Report the largest compressed frame. */
+		if (fmt->pixelformat == v4l2_fourcc('M', 'J', 'P', 'G')) {
+			fmt->sizeimage = 0;
+			list_for_each_entry(slide, &src->slides, list)
+				fmt->sizeimage = max(fmt->sizeimage,
+						     slide->imgsize);
+		}
+
+		return 0;
+	}
 
 	/*
 	* At present, there is no means of stalling a USB SET_CUR control from
@@ -277,12 +281,40 @@ err_dummy_slide:
 	return ret;
 }
 
-static int slideshow_source_set_frame_rate(struct video_source *s,
-					   unsigned int fps)
+static int slideshow_source_reload(struct video_source *s)
 {
 	struct slideshow_source *src = to_slideshow_source(s);
+	struct slide *slide, *next;
+	struct list_entry slides;
+	int ret;
+
+	/* Nothing to reload until a format has been set. */
+	if (!src->fmt.pixelformat)
+		return 0;
+
+	/* Keep the current slides if the new ones can't be loaded. */
+	list_init(&slides);
+	ret = slideshow_source_load_slides(src, &src->fmt, &slides);
+	if (ret < 0)
+		return ret;
+
+	slideshow_source_free_slides(&src->slides);
 
-	timer_set_fps(src->timer, fps);
+	list_for_each_entry_safe(slide, next, &slides, list) {
+		list_remove(&slide->list);
+		list_append(&slide->list, &src->slides);
+	}
+
+	src->cur_slide = list_first_entry(&src->slides, struct slide, list);
+
+	return 0;
+}
+static int slideshow_source_set_frame_interval(struct video_source *s,
+					       unsigned int interval)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+
+	timer_set_interval(src->timer, interval * 100ULL);
 
 	return 0;
 }
@@ -292,16 +324,62 @@ static int slideshow_source_free_buffers(struct video_source *s __attribute__((u
 	return 0;
 }
 
+static void slideshow_source_fill_buffer(struct video_source *s,
+					 struct video_buffer *buf)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+
+	/* Reloaded slides may not fit in buffers sized for the previous ones. */
+	if (src->cur_slide->imgsize > buf->size) {
+		buf->bytesused = 0;
+		buf->error = true;
+	} else {
+		memcpy(buf->mem, src->cur_slide->imgdata,
+		       src->cur_slide->imgsize);
+		buf->bytesused = src->cur_slide->imgsize;
+	}
+
+	if (src->cur_slide == list_last_entry(&src->slides, struct slide, list))
+		src->cur_slide = list_first_entry(&src->slides, struct slide, list);
+	else
+		src->cur_slide = list_next_entry(&src->cur_slide->list, struct slide, list);
+}
+
+static void slideshow_source_timer_expired(void *d)
+{
+	struct slideshow_source *src = d;
+	struct video_buffer buf;
+
+	/*
+	 * Produce a frame at every timer period to ensure that our configured
+	 * frame rate is adhered to. If all buffers are queued to the sink the
+	 * frame is skipped.
+	 */
+	if (!video_buffer_queue_pop(&src->buffers, &buf))
+		return;
+
+	slideshow_source_fill_buffer(&src->src, &buf);
+	src->src.handler(src->src.handler_data, &src->src, &buf);
+}
+
 static int slideshow_source_stream_on(struct video_source *s)
 {
 	struct slideshow_source *src = to_slideshow_source(s);
 	int ret;
 
+	ret = events_add_timer(src->src.events, src->timer,
+			       slideshow_source_timer_expired, src);
+	if (ret < 0)
+		return ret;
+
+	src->timer_watch = ret;
+
 	ret = timer_arm(src->timer);
-	if (ret)
+	if (ret) {
+		events_unwatch(src->src.events, src->timer_watch);
 		return ret;
+	}
 
-	src->streaming = true;
 	return 0;
 }
 
@@ -314,41 +392,32 @@ static int slideshow_source_stream_off(struct video_source *s)
 	 * even if the timer is still running due to the failure.
 	 */
 	timer_disarm(src->timer);
-	src->streaming = false;
+	events_unwatch(src->src.events, src->timer_watch);
+
+	/* The sink owns all buffers again once streaming is stopped. */
+	video_buffer_queue_init(&src->buffers);
 
 	return 0;
 }
 
-static void slideshow_source_fill_buffer(struct video_source *s,
+static int slideshow_source_queue_buffer(struct video_source *s,
 					 struct video_buffer *buf)
 {
 	struct slideshow_source *src = to_slideshow_source(s);
 
-	memcpy(buf->mem, src->cur_slide->imgdata, src->cur_slide->imgsize);
-	buf->bytesused = src->cur_slide->imgsize;
-
-	if (src->cur_slide == list_last_entry(&src->slides, struct slide, list))
-		src->cur_slide = list_first_entry(&src->slides, struct slide, list);
-	else
-		src->cur_slide = list_next_entry(&src->cur_slide->list, struct slide, list);
-
-	/*
-	 * Wait for the timer to elapse to ensure that our configured frame rate
-	 * is adhered to.
-	 */
-	if (src->streaming)
-		timer_wait(src->timer);
+	return video_buffer_queue_push(&src->buffers, buf);
 }
 
 static const struct video_source_ops slideshow_source_ops = {
 	.destroy = slideshow_source_destroy,
 	.set_format = slideshow_source_set_format,
-	.set_frame_rate = slideshow_source_set_frame_rate,
+	.set_frame_interval = slideshow_source_set_frame_interval,
 	.free_buffers = slideshow_source_free_buffers,
 	.stream_on = slideshow_source_stream_on,
 	.stream_off = slideshow_source_stream_off,
-	.queue_buffer = NULL,
+	.queue_buffer = slideshow_source_queue_buffer,
 	.fill_buffer = slideshow_source_fill_buffer,
+	.reload = slideshow_source_reload,
 };
 
 struct video_source *slideshow_video_source_create(const char *img_dir)
@@ -375,6 +444,7 @@ struct video_source *slideshow_video_source_create(const char *img_dir)
 		goto err_free_src;
 
 	list_init(&src->slides);
+	video_buffer_queue_init(&src->buffers);
 
 	return &src->src;
 
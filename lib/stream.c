@@ -7,233 +7,2063 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/dma-buf.h>
 
 #include "events.h"
+#include "histogram.h"
 #include "stream.h"
+#include "timer.h"
+#include "tools.h"
 #include "uvc.h"
 #include "v4l2.h"
 #include "video-buffers.h"
 #include "video-source.h"
 
-/*
- * struct uvc_stream - Representation of a UVC stream
- * @src: video source
- * @uvc: UVC V4L2 output device
- * @events: struct events containing event information
- */
-struct uvc_stream
+#define UVC_STREAM_DEFAULT_BUFFERS	4
+#define UVC_STREAM_MIN_BUFFERS		2
+#define UVC_STREAM_AUTO_MAX_BUFFERS	8
+#define UVC_STREAM_AUTO_WINDOW		120
+
+/*
+ * Number of frames queued to the sink above which the sink is considered as
+ * saturated: one frame being transferred and one frame ready to be transferred
+ * next.
+ */
+#define UVC_STREAM_SINK_MAX_QUEUED	2
+
+#define UVC_STREAM_MAX_FILL_WORKERS	8
+
+#define UVC_STREAM_STILL_BUFFERS	2
+
+/*
+ * struct uvc_stream_depth - Buffer queue depth control
+ * @nbufs: Requested number of buffers, 0 for automatic mode
+ * @depth: Number of buffers to keep in circulation
+ * @floor: Lowest depth known to be free of underruns (automatic mode only)
+ * @max: Highest depth (automatic mode only)
+ * @frames: Number of frames completed in the current observation window
+ * @min_latency: Lowest sink queue latency in the current observation window,
+ *	in ns
+ * @empty_since: Time at which the sink queue ran empty, in ns, 0 if the sink
+ *	queue isn't empty
+ * @queued: Number of buffers queued to the sink
+ * @queued_mask: Buffers queued to the sink, as a bitmask of buffer indices
+ * @queued_at: Time at which each buffer has been queued to the sink, in ns
+ * @parked: Buffers taken out of circulation
+ */
+struct uvc_stream_depth {
+	unsigned int nbufs;
+	unsigned int depth;
+	unsigned int floor;
+	unsigned int max;
+
+	unsigned int frames;
+	uint64_t min_latency;
+	uint64_t empty_since;
+
+	unsigned int queued;
+	uint32_t queued_mask;
+	uint64_t queued_at[VIDEO_BUFFER_QUEUE_SIZE];
+	struct video_buffer_queue parked;
+};
+
+/*
+ * struct uvc_stream_rate - Source and sink rate matching
+ * @policy: Rate matching policy (UVC_STREAM_RATE_* flags)
+ * @pending: Frame waiting for the sink to have room
+ * @has_pending: True if @pending holds a frame
+ * @last: Last frame transferred by the sink, held back for repetition
+ * @has_last: True if @last holds a frame
+ * @timer: Timer for the next frame repetition
+ * @timer_watch: Handle of the @timer watch
+ * @dropped: Number of frames dropped due to sink saturation
+ * @repeated: Number of frames repeated due to source underrun
+ */
+struct uvc_stream_rate {
+	unsigned int policy;
+
+	struct video_buffer pending;
+	bool has_pending;
+	struct video_buffer last;
+	bool has_last;
+
+	struct timer *timer;
+	int timer_watch;
+
+	unsigned int dropped;
+	unsigned int repeated;
+};
+
+/*
+ * struct uvc_stream_pacing - Frame pacing for synchronous sources
+ * @timer: Deadline timer
+ * @timer_watch: Handle of the @timer watch, -1 when pacing is inactive
+ * @deadline: Next frame deadline, in ns
+ * @ready: Filled buffers waiting for their deadline
+ * @frames: Number of frames queued to the sink at their deadline
+ * @missed: Number of deadlines missed
+ */
+struct uvc_stream_pacing {
+	struct timer *timer;
+	int timer_watch;
+	uint64_t deadline;
+	struct video_buffer_queue ready;
+	uint64_t frames;
+	uint64_t missed;
+};
+
+/*
+ * struct uvc_stream_fill_job - Buffer fill job
+ * @buf: The buffer to fill
+ * @done: True if the buffer has been filled
+ */
+struct uvc_stream_fill_job {
+	struct video_buffer buf;
+	bool done;
+};
+
+/*
+ * struct uvc_stream_fill - Buffer fill workers
+ * @workers: Requested number of worker threads
+ * @threads: Worker threads
+ * @nthreads: Number of running worker threads
+ * @lock: Protects the fields below
+ * @cond: Signals new jobs and stop requests to the workers
+ * @idle: Signals that the workers are idle
+ * @pending: Buffers waiting to be filled
+ * @busy: Number of buffers being filled
+ * @stop: True to request the workers to stop
+ * @paused: True to keep the workers from starting new jobs
+ * @jobs: Fill jobs, indexed by buffer index
+ * @order: Buffers submitted for filling, in submission order
+ */
+struct uvc_stream_fill {
+	unsigned int workers;
+	pthread_t threads[UVC_STREAM_MAX_FILL_WORKERS];
+	unsigned int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle;
+	struct video_buffer_queue pending;
+	unsigned int busy;
+	bool stop;
+	bool paused;
+
+	struct uvc_stream_fill_job jobs[VIDEO_BUFFER_QUEUE_SIZE];
+	struct video_buffer_queue order;
+};
+
+/*
+ * struct uvc_stream_metrics - Stream statistics
+ * @stats: Counters reported by uvc_stream_get_stats()
+ * @interval: Interval between frames completed by the sink
+ * @latency: Time from frame capture to completion by the sink
+ * @queue_latency: Time from frame capture to queueing to the sink
+ * @transfer_latency: Time from queueing to completion by the sink
+ * @last_complete: Time at which the sink last completed a frame, in ns
+ * @captured_at: Capture time of the frame in each buffer, in ns, 0 if unknown
+ * @threshold: Latency above which frames are logged, in ns, 0 to disable
+ * @logged_at: Time of the last latency message, in ns
+ * @over_threshold: Number of frames over the threshold since the last message
+ */
+struct uvc_stream_metrics {
+	struct uvc_stream_stats stats;
+	struct histogram *interval;
+	struct histogram *latency;
+	struct histogram *queue_latency;
+	struct histogram *transfer_latency;
+	uint64_t last_complete;
+	uint64_t captured_at[VIDEO_BUFFER_QUEUE_SIZE];
+
+	uint64_t threshold;
+	uint64_t logged_at;
+	unsigned int over_threshold;
+};
+
+/*
+ * struct uvc_stream_still - Still image capture
+ * @src: Video source dedicated to still images, NULL if stills are disabled
+ * @handler: Function called with each captured still image
+ * @handler_data: Private data passed to @handler
+ * @format: Format of the still image
+ * @buf: Buffer receiving the still image, separate from the stream buffers
+ * @buffers: Buffers exported by @src and mapped, NULL if @src fills buffers
+ * @timer: Timer running the capture from the event loop
+ * @timer_watch: Handle of the @timer watch, -1 when no capture is in progress
+ * @captured: True once a frame has been copied to @buf
+ */
+struct uvc_stream_still {
+	struct video_source *src;
+	uvc_stream_still_handler_t handler;
+	void *handler_data;
+
+	struct v4l2_pix_format format;
+	struct video_buffer buf;
+	struct video_buffer_set *buffers;
+
+	struct timer *timer;
+	int timer_watch;
+	bool captured;
+};
+
+/*
+ * struct uvc_stream - Representation of a UVC stream
+ * @src: video source
+ * @uvc: UVC V4L2 output device
+ * @events: struct events containing event information
+ * @sink_watch: Handle of the UVC V4L2 output device watch
+ * @interval: Frame interval, in ns, 0 if unknown
+ * @format: Format requested for the stream
+ * @allocated: True if buffers are allocated on the source and sink
+ * @owner: Video source that allocated the buffers, NULL if the sink did
+ * @draining: True while waiting for the sink to release all buffers before
+ *	starting the video source that allocated them
+ * @realloc: True if the buffers must be reallocated when the stream stops
+ * @prewarm: True if the stream is prepared when the host commits the format
+ * @prewarmed: True if the stream has been prepared ahead of the sink start
+ * @start_time: Time at which the stream has been started, in ns, reset to 0
+ *	once the first frame has been transferred
+ * @depth: Buffer queue depth control
+ * @rate: Source and sink rate matching
+ * @pacing: Frame pacing for synchronous sources
+ * @fill: Buffer fill workers
+ * @still: Still image capture
+ * @metrics: Stream statistics
+ */
+struct uvc_stream
+{
+	struct video_source *src;
+	struct uvc_device *uvc;
+
+	struct events *events;
+	int sink_watch;
+
+	uint64_t interval;
+
+	struct v4l2_pix_format format;
+	bool allocated;
+	struct video_source *owner;
+	bool draining;
+	bool realloc;
+	bool prewarm;
+	bool prewarmed;
+	uint64_t start_time;
+
+	struct uvc_stream_depth depth;
+	struct uvc_stream_rate rate;
+	struct uvc_stream_pacing pacing;
+	struct uvc_stream_fill fill;
+	struct uvc_stream_still still;
+	struct uvc_stream_metrics metrics;
+};
+
+/* ---------------------------------------------------------------------------
+ * Buffer queue depth
+ *
+ * The number of buffers in circulation between the source and the sink is
+ * either fixed, or adjusted automatically to the lowest value that doesn't
+ * cause sink underruns.
+ *
+ * In automatic mode, an underrun (the sink queue staying empty for more than a
+ * frame interval) raises the depth by one buffer, and records the new depth as
+ * the floor that the depth will not be lowered below anymore. When buffers
+ * spend more than a frame interval in the sink queue for a full observation
+ * window, they only add latency, and the depth is lowered by one buffer.
+ *
+ * Lowering the depth parks buffers when they complete on the sink. Raising it
+ * returns parked buffers to circulation first, and otherwise allocates new
+ * sink buffers with VIDIOC_CREATE_BUFS when the sink owns the buffer memory.
+ * Buffers exported by the video source can't be added at runtime, the source
+ * allocates UVC_STREAM_AUTO_MAX_BUFFERS buffers upfront in automatic mode.
+ */
+
+static uint64_t uvc_stream_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sources that allocate buffers or pace frame production produce frames
+ * asynchronously, other sources fill buffers synchronously.
+ */
+static bool uvc_stream_async_source(struct uvc_stream *stream)
+{
+	return stream->src->ops->alloc_buffers || stream->src->ops->queue_buffer;
+}
+
+/*
+ * Only synchronous sources whose fill_buffer operation is reentrant can be
+ * filled by the workers, other sources are filled in the event loop.
+ */
+static bool uvc_stream_parallel_fill(struct uvc_stream *stream)
+{
+	return !uvc_stream_async_source(stream) &&
+	       (stream->src->ops->flags & VIDEO_SOURCE_FILL_REENTRANT);
+}
+
+static void uvc_stream_depth_reset(struct uvc_stream *stream,
+				   unsigned int nbufs, unsigned int max)
+{
+	struct uvc_stream_depth *depth = &stream->depth;
+
+	depth->depth = min(nbufs, max);
+	depth->floor = 0;
+	depth->max = max;
+	depth->frames = 0;
+	depth->min_latency = UINT64_MAX;
+	depth->empty_since = 0;
+	depth->queued = 0;
+	depth->queued_mask = 0;
+	video_buffer_queue_init(&depth->parked);
+}
+
+static unsigned int uvc_stream_circulating_buffers(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+
+	return sink->buffers.nbufs - stream->depth.parked.count;
+}
+
+static void uvc_stream_update_depth(struct uvc_stream *stream,
+				    uint64_t latency)
+{
+	struct uvc_stream_depth *depth = &stream->depth;
+
+	if (depth->nbufs || !stream->interval)
+		return;
+
+	depth->min_latency = min(depth->min_latency, latency);
+
+	if (++depth->frames < UVC_STREAM_AUTO_WINDOW)
+		return;
+
+	if (depth->min_latency > stream->interval &&
+	    depth->depth > max_t(unsigned int, depth->floor,
+				 UVC_STREAM_MIN_BUFFERS)) {
+		depth->depth--;
+		printf("Lowering buffer queue depth to %u\n", depth->depth);
+	}
+
+	depth->frames = 0;
+	depth->min_latency = UINT64_MAX;
+}
+
+static void uvc_stream_recycle_buffer(struct uvc_stream *stream,
+				      struct video_buffer *buf);
+
+static void uvc_stream_raise_depth(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_depth *depth = &stream->depth;
+	struct video_buffer buf;
+	int ret;
+
+	depth->frames = 0;
+	depth->min_latency = UINT64_MAX;
+
+	if (depth->depth >= depth->max)
+		return;
+
+	depth->depth++;
+	depth->floor = depth->depth;
+
+	printf("Sink underrun, raising buffer queue depth to %u\n",
+	       depth->depth);
+
+	/* Buffers pending parking are simply kept in circulation. */
+	if (uvc_stream_circulating_buffers(stream) >= depth->depth)
+		return;
+
+	if (video_buffer_queue_pop(&depth->parked, &buf)) {
+		uvc_stream_recycle_buffer(stream, &buf);
+		return;
+	}
+
+	if (stream->owner)
+		goto no_buffer;
+
+	ret = v4l2_create_buffers(sink, 1);
+	if (ret <= 0)
+		goto no_buffer;
+
+	ret = v4l2_mmap_buffers(sink);
+	if (ret < 0)
+		goto no_buffer;
+
+	buf = sink->buffers.buffers[sink->buffers.nbufs - 1];
+	uvc_stream_recycle_buffer(stream, &buf);
+	return;
+
+no_buffer:
+	/* Stay at the current depth. */
+	depth->depth = uvc_stream_circulating_buffers(stream);
+	depth->max = depth->depth;
+}
+
+/* ---------------------------------------------------------------------------
+ * Statistics
+ */
+
+static void uvc_stream_metrics_reset(struct uvc_stream *stream)
+{
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+
+	memset(&metrics->stats, 0, sizeof(metrics->stats));
+	histogram_reset(metrics->interval);
+	histogram_reset(metrics->latency);
+	histogram_reset(metrics->queue_latency);
+	histogram_reset(metrics->transfer_latency);
+	metrics->last_complete = 0;
+	memset(metrics->captured_at, 0, sizeof(metrics->captured_at));
+	metrics->logged_at = 0;
+	metrics->over_threshold = 0;
+}
+
+/*
+ * Record the capture time of a frame, from the buffer timestamp if available.
+ * Otherwise timestamp the buffer, the timestamp is passed to the sink.
+ */
+static void uvc_stream_metrics_capture(struct uvc_stream *stream,
+				       struct video_buffer *buf)
+{
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+	uint64_t now = uvc_stream_clock();
+	uint64_t timestamp;
+
+	if (buf->index >= ARRAY_SIZE(metrics->captured_at))
+		return;
+
+	timestamp = (uint64_t)buf->timestamp.tv_sec * 1000000000ULL
+		  + (uint64_t)buf->timestamp.tv_usec * 1000;
+	if (!timestamp || timestamp > now) {
+		timestamp = now;
+		buf->timestamp.tv_sec = now / 1000000000ULL;
+		buf->timestamp.tv_usec = now % 1000000000ULL / 1000;
+	}
+
+	metrics->captured_at[buf->index] = timestamp;
+}
+
+static void uvc_stream_metrics_queue(struct uvc_stream *stream,
+				     const struct video_buffer *buf,
+				     uint64_t now)
+{
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+	uint64_t captured_at;
+
+	metrics->stats.sink_queued++;
+
+	if (buf->index >= ARRAY_SIZE(metrics->captured_at))
+		return;
+
+	captured_at = metrics->captured_at[buf->index];
+	if (captured_at)
+		histogram_record(metrics->queue_latency, now - captured_at);
+}
+
+static void uvc_stream_metrics_log(struct uvc_stream *stream,
+				   uint64_t captured_at, uint64_t queued_at,
+				   uint64_t now)
+{
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+
+	metrics->over_threshold++;
+
+	if (metrics->logged_at && now - metrics->logged_at < 1000000000ULL)
+		return;
+
+	printf("Frame latency %llu us over threshold (queue %llu us, transfer %llu us), %u frames since last report\n",
+	       (unsigned long long)(now - captured_at) / 1000,
+	       (unsigned long long)(queued_at - captured_at) / 1000,
+	       (unsigned long long)(now - queued_at) / 1000,
+	       metrics->over_threshold);
+
+	metrics->logged_at = now;
+	metrics->over_threshold = 0;
+}
+
+static void uvc_stream_metrics_complete(struct uvc_stream *stream,
+					const struct video_buffer *buf,
+					uint64_t now)
+{
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+	uint64_t captured_at = 0;
+	uint64_t queued_at = 0;
+
+	metrics->stats.sink_dequeued++;
+
+	if (buf->index < ARRAY_SIZE(metrics->captured_at)) {
+		captured_at = metrics->captured_at[buf->index];
+		metrics->captured_at[buf->index] = 0;
+		queued_at = stream->depth.queued_at[buf->index];
+	}
+
+	if (buf->error) {
+		metrics->stats.sink_errors++;
+		return;
+	}
+
+	metrics->stats.bytes += buf->bytesused;
+
+	if (metrics->last_complete)
+		histogram_record(metrics->interval,
+				 now - metrics->last_complete);
+	metrics->last_complete = now;
+
+	if (queued_at)
+		histogram_record(metrics->transfer_latency, now - queued_at);
+
+	if (!captured_at)
+		return;
+
+	histogram_record(metrics->latency, now - captured_at);
+
+	if (metrics->threshold && now - captured_at > metrics->threshold &&
+	    queued_at >= captured_at)
+		uvc_stream_metrics_log(stream, captured_at, queued_at, now);
+}
+
+/* ---------------------------------------------------------------------------
+ * Video streaming
+ */
+
+static int uvc_stream_queue_sink(struct uvc_stream *stream,
+				 struct video_buffer *buf)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_depth *depth = &stream->depth;
+	uint64_t now = uvc_stream_clock();
+	bool underrun;
+	int ret;
+
+	underrun = !depth->queued && depth->empty_since && stream->interval &&
+		   now - depth->empty_since > stream->interval;
+
+	ret = v4l2_queue_buffer(sink, buf);
+	if (ret < 0)
+		return ret;
+
+	depth->queued++;
+	depth->empty_since = 0;
+	if (buf->index < ARRAY_SIZE(depth->queued_at)) {
+		depth->queued_at[buf->index] = now;
+		depth->queued_mask |= 1U << buf->index;
+	}
+
+	uvc_stream_metrics_queue(stream, buf, now);
+
+	if (underrun) {
+		stream->metrics.stats.underruns++;
+		if (!depth->nbufs)
+			uvc_stream_raise_depth(stream);
+	}
+
+	return 0;
+}
+
+static int uvc_stream_dequeue_sink(struct uvc_stream *stream,
+				   struct video_buffer *buf)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_depth *depth = &stream->depth;
+	uint64_t now;
+	int ret;
+
+	ret = v4l2_dequeue_buffer(sink, buf);
+	if (ret < 0)
+		return ret;
+
+	now = uvc_stream_clock();
+
+	if (stream->start_time) {
+		stream->metrics.stats.time_to_first_frame = now - stream->start_time;
+		printf("Time to first frame: %llu us\n",
+		       (unsigned long long)(now - stream->start_time) / 1000);
+		stream->start_time = 0;
+	}
+
+	if (depth->queued && !--depth->queued)
+		depth->empty_since = now;
+	if (buf->index < ARRAY_SIZE(depth->queued_at))
+		depth->queued_mask &= ~(1U << buf->index);
+
+	uvc_stream_metrics_complete(stream, buf, now);
+
+	if (buf->index < ARRAY_SIZE(depth->queued_at))
+		uvc_stream_update_depth(stream,
+					now - depth->queued_at[buf->index]);
+
+	return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame pacing
+ *
+ * Synchronous sources fill buffers as soon as the sink releases them, and
+ * would otherwise run at the rate the host consumes frames. Their frames are
+ * held in a ready queue, and queued to the sink at absolute deadlines on
+ * CLOCK_MONOTONIC, spaced by the committed frame interval from the time the
+ * stream started. Deadlines are computed from the previous deadline rather than
+ * from the wake-up time, which doesn't accumulate wake-up latency, and keeps
+ * the delivered frame rate equal to the negotiated rate over long runs.
+ *
+ * When no frame is ready at a deadline, or when the scheduler wakes up after
+ * one or more later deadlines have passed, the missed deadlines are counted
+ * and skipped. Frames are never queued in bursts to catch up.
+ */
+
+static void uvc_stream_pacing_tick(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_pacing *pacing = &stream->pacing;
+	struct video_buffer buf;
+	uint64_t now = uvc_stream_clock();
+	uint64_t late;
+
+	/* Skip the deadlines that passed while the scheduler was late. */
+	if (now >= pacing->deadline + stream->interval) {
+		late = (now - pacing->deadline) / stream->interval;
+		pacing->missed += late;
+		pacing->deadline += late * stream->interval;
+	}
+
+	if (video_buffer_queue_pop(&pacing->ready, &buf)) {
+		if (uvc_stream_queue_sink(stream, &buf) == 0)
+			pacing->frames++;
+	} else {
+		pacing->missed++;
+	}
+
+	pacing->deadline += stream->interval;
+	timer_arm_at(pacing->timer, pacing->deadline);
+}
+
+static void uvc_stream_pacing_start(struct uvc_stream *stream)
+{
+	struct uvc_stream_pacing *pacing = &stream->pacing;
+	int ret;
+
+	video_buffer_queue_init(&pacing->ready);
+	pacing->frames = 0;
+	pacing->missed = 0;
+
+	if (!stream->interval || uvc_stream_async_source(stream))
+		return;
+
+	ret = events_add_timer(stream->events, pacing->timer,
+			       uvc_stream_pacing_tick, stream);
+	if (ret < 0) {
+		printf("Failed to watch pacing timer, frames won't be paced\n");
+		return;
+	}
+
+	pacing->timer_watch = ret;
+}
+
+/*
+ * Start the deadlines when the sink starts streaming. Frames filled before
+ * are held in the ready queue, the first one being queued to the sink
+ * directly.
+ */
+static void uvc_stream_pacing_arm(struct uvc_stream *stream)
+{
+	struct uvc_stream_pacing *pacing = &stream->pacing;
+
+	if (pacing->timer_watch < 0)
+		return;
+
+	/* The first frame is queued immediately, the next one is due next. */
+	pacing->deadline = uvc_stream_clock() + stream->interval;
+	timer_arm_at(pacing->timer, pacing->deadline);
+}
+
+static void uvc_stream_pacing_stop(struct uvc_stream *stream)
+{
+	struct uvc_stream_pacing *pacing = &stream->pacing;
+
+	if (pacing->timer_watch < 0)
+		return;
+
+	timer_disarm(pacing->timer);
+	events_unwatch(stream->events, pacing->timer_watch);
+	pacing->timer_watch = -1;
+
+	/* The sink owns all buffers again once streaming is stopped. */
+	video_buffer_queue_init(&pacing->ready);
+
+	printf("Frame pacing: %llu frames, %llu deadlines missed\n",
+	       (unsigned long long)pacing->frames,
+	       (unsigned long long)pacing->missed);
+}
+
+/* Queue a filled buffer to the sink, at its deadline if frames are paced. */
+static int uvc_stream_deliver(struct uvc_stream *stream,
+			      struct video_buffer *buf)
+{
+	struct uvc_stream_pacing *pacing = &stream->pacing;
+
+	if (pacing->timer_watch >= 0 &&
+	    !video_buffer_queue_push(&pacing->ready, buf))
+		return 0;
+
+	return uvc_stream_queue_sink(stream, buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * Fill workers
+ *
+ * Buffers of synchronous sources are filled by worker threads when enabled.
+ * The event loop submits the buffers released by the sink, and the workers
+ * post completions back to the event loop, which queues the filled buffers to
+ * the sink in submission order. Jobs are flushed when the stream stops, a
+ * completion then finds no filled buffer and has no effect.
+ */
+
+static void uvc_stream_fill_complete(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_fill *fill = &stream->fill;
+	const struct video_buffer *next;
+	struct video_buffer ready[VIDEO_BUFFER_QUEUE_SIZE];
+	unsigned int count = 0;
+	unsigned int i;
+
+	pthread_mutex_lock(&fill->lock);
+
+	while ((next = video_buffer_queue_peek(&fill->order)) &&
+	       fill->jobs[next->index].done) {
+		struct uvc_stream_fill_job *job = &fill->jobs[next->index];
+		struct video_buffer buf;
+
+		video_buffer_queue_pop(&fill->order, &buf);
+		job->done = false;
+		ready[count++] = job->buf;
+	}
+
+	pthread_mutex_unlock(&fill->lock);
+
+	stream->metrics.stats.source_dequeued += count;
+
+	for (i = 0; i < count; ++i)
+		uvc_stream_deliver(stream, &ready[i]);
+}
+
+static void *uvc_stream_fill_worker(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_fill *fill = &stream->fill;
+	struct video_buffer buf;
+
+	pthread_mutex_lock(&fill->lock);
+
+	while (true) {
+		struct uvc_stream_fill_job *job;
+
+		while (!fill->stop && (fill->paused || !fill->pending.count))
+			pthread_cond_wait(&fill->cond, &fill->lock);
+
+		if (fill->stop)
+			break;
+
+		video_buffer_queue_pop(&fill->pending, &buf);
+		job = &fill->jobs[buf.index];
+		fill->busy++;
+
+		pthread_mutex_unlock(&fill->lock);
+
+		video_source_fill_buffer(stream->src, &job->buf);
+
+		pthread_mutex_lock(&fill->lock);
+
+		job->done = true;
+		events_post(stream->events, uvc_stream_fill_complete, stream);
+
+		if (!--fill->busy)
+			pthread_cond_broadcast(&fill->idle);
+	}
+
+	pthread_mutex_unlock(&fill->lock);
+
+	return NULL;
+}
+
+static void uvc_stream_fill_stop_workers(struct uvc_stream *stream)
+{
+	struct uvc_stream_fill *fill = &stream->fill;
+	unsigned int i;
+
+	if (!fill->nthreads)
+		return;
+
+	pthread_mutex_lock(&fill->lock);
+	fill->stop = true;
+	pthread_cond_broadcast(&fill->cond);
+	pthread_mutex_unlock(&fill->lock);
+
+	for (i = 0; i < fill->nthreads; ++i)
+		pthread_join(fill->threads[i], NULL);
+
+	fill->nthreads = 0;
+	fill->stop = false;
+}
+
+static void uvc_stream_fill_start_workers(struct uvc_stream *stream)
+{
+	struct uvc_stream_fill *fill = &stream->fill;
+	int ret;
+
+	if (fill->nthreads == fill->workers)
+		return;
+
+	uvc_stream_fill_stop_workers(stream);
+
+	while (fill->nthreads < fill->workers) {
+		ret = pthread_create(&fill->threads[fill->nthreads], NULL,
+				     uvc_stream_fill_worker, stream);
+		if (ret) {
+			printf("Failed to create fill worker: %s (%d)\n",
+			       strerror(ret), ret);
+			break;
+		}
+
+		fill->nthreads++;
+	}
+}
+
+/* Drop the pending jobs and wait for the jobs in progress to complete. */
+static void uvc_stream_fill_flush(struct uvc_stream *stream)
+{
+	struct uvc_stream_fill *fill = &stream->fill;
+	unsigned int i;
+
+	if (!fill->nthreads)
+		return;
+
+	pthread_mutex_lock(&fill->lock);
+
+	video_buffer_queue_init(&fill->pending);
+	while (fill->busy)
+		pthread_cond_wait(&fill->idle, &fill->lock);
+
+	for (i = 0; i < ARRAY_SIZE(fill->jobs); ++i)
+		fill->jobs[i].done = false;
+	video_buffer_queue_init(&fill->order);
+
+	pthread_mutex_unlock(&fill->lock);
+}
+
+static bool uvc_stream_fill_submit(struct uvc_stream *stream,
+				   struct video_buffer *buf)
+{
+	struct uvc_stream_fill *fill = &stream->fill;
+	struct uvc_stream_fill_job *job;
+
+	if (!fill->nthreads || buf->index >= ARRAY_SIZE(fill->jobs))
+		return false;
+
+	job = &fill->jobs[buf->index];
+
+	stream->metrics.stats.source_queued++;
+	uvc_stream_metrics_capture(stream, buf);
+
+	pthread_mutex_lock(&fill->lock);
+
+	if (video_buffer_queue_push(&fill->order, buf) < 0) {
+		pthread_mutex_unlock(&fill->lock);
+		return false;
+	}
+
+	job->buf = *buf;
+	job->done = false;
+	video_buffer_queue_push(&fill->pending, buf);
+	pthread_cond_signal(&fill->cond);
+	pthread_mutex_unlock(&fill->lock);
+
+	return true;
+}
+
+static void uvc_stream_fill_sync(struct uvc_stream *stream,
+				 struct video_buffer *buf)
+{
+	stream->metrics.stats.source_queued++;
+	uvc_stream_metrics_capture(stream, buf);
+
+	video_source_fill_buffer(stream->src, buf);
+
+	stream->metrics.stats.source_dequeued++;
+}
+
+/*
+ * Hand an empty buffer to the source. Sources that allocate buffers or pace
+ * frame production return filled buffers through the buffer handler, other
+ * sources fill the buffer synchronously, or through the fill workers.
+ */
+static void uvc_stream_recycle_buffer(struct uvc_stream *stream,
+				      struct video_buffer *buf)
+{
+	if (stream->src->ops->alloc_buffers || stream->src->ops->queue_buffer) {
+		stream->metrics.stats.source_queued++;
+		video_source_queue_buffer(stream->src, buf);
+		return;
+	}
+
+	if (uvc_stream_fill_submit(stream, buf))
+		return;
+
+	uvc_stream_fill_sync(stream, buf);
+	uvc_stream_deliver(stream, buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * Rate matching
+ *
+ * Sources that produce frames asynchronously (capture devices and paced
+ * sources) run at their own rate, which can differ from the rate at which the
+ * host consumes frames over USB.
+ *
+ * When the source is faster, queueing every frame to the sink would build up
+ * latency. With the UVC_STREAM_RATE_DROP policy, frames are only queued while
+ * the sink isn't saturated, and the most recent frame is otherwise kept pending
+ * until the sink has room, dropping the older pending frame.
+ *
+ * When the source is slower, the sink would run out of frames and the host
+ * would starve. With the UVC_STREAM_RATE_REPEAT policy, the last frame is held
+ * back when the sink runs out of frames, and queued again if no new frame is
+ * available by the time the next frame is due.
+ */
+
+/* A new frame is available, return the held frame to the source. */
+static void uvc_stream_release_last(struct uvc_stream *stream)
+{
+	struct uvc_stream_rate *rate = &stream->rate;
+
+	if (!rate->has_last)
+		return;
+
+	timer_disarm(rate->timer);
+	rate->has_last = false;
+	uvc_stream_recycle_buffer(stream, &rate->last);
+}
+
+static bool uvc_stream_hold_last(struct uvc_stream *stream,
+				 struct video_buffer *buf)
+{
+	struct uvc_stream_rate *rate = &stream->rate;
+	struct uvc_stream_depth *depth = &stream->depth;
+	uint64_t deadline;
+	uint64_t now;
+
+	if (!(rate->policy & UVC_STREAM_RATE_REPEAT) || rate->timer_watch < 0 ||
+	    !stream->interval || !uvc_stream_async_source(stream))
+		return false;
+
+	if (depth->queued || rate->has_pending || rate->has_last)
+		return false;
+
+	/*
+	 * The next frame is due one interval after this one was queued. Allow
+	 * half an interval of jitter before repeating, to avoid sending
+	 * duplicates when the source runs at the nominal rate.
+	 */
+	now = uvc_stream_clock();
+	deadline = now;
+	if (buf->index < ARRAY_SIZE(depth->queued_at))
+		deadline = depth->queued_at[buf->index];
+	deadline += stream->interval + stream->interval / 2;
+
+	if (timer_arm_once(rate->timer, deadline > now ? deadline - now : 0))
+		return false;
+
+	rate->last = *buf;
+	rate->has_last = true;
+
+	return true;
+}
+
+static void uvc_stream_repeat_frame(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_rate *rate = &stream->rate;
+
+	if (!rate->has_last)
+		return;
+
+	rate->has_last = false;
+
+	/* Repeated frames don't account for capture latency. */
+	if (rate->last.index < ARRAY_SIZE(stream->metrics.captured_at))
+		stream->metrics.captured_at[rate->last.index] = 0;
+
+	if (uvc_stream_queue_sink(stream, &rate->last) < 0) {
+		uvc_stream_recycle_buffer(stream, &rate->last);
+		return;
+	}
+
+	rate->repeated++;
+}
+
+static void uvc_stream_rate_start(struct uvc_stream *stream)
+{
+	struct uvc_stream_rate *rate = &stream->rate;
+	int ret;
+
+	rate->has_pending = false;
+	rate->has_last = false;
+	rate->dropped = 0;
+	rate->repeated = 0;
+
+	if (!(rate->policy & UVC_STREAM_RATE_REPEAT) || rate->timer_watch >= 0)
+		return;
+
+	ret = events_add_timer(stream->events, rate->timer,
+			       uvc_stream_repeat_frame, stream);
+	if (ret < 0) {
+		printf("Failed to watch repeat timer, frames won't be repeated\n");
+		return;
+	}
+
+	rate->timer_watch = ret;
+}
+
+static void uvc_stream_rate_stop(struct uvc_stream *stream)
+{
+	struct uvc_stream_rate *rate = &stream->rate;
+
+	if (rate->timer_watch >= 0) {
+		timer_disarm(rate->timer);
+		events_unwatch(stream->events, rate->timer_watch);
+		rate->timer_watch = -1;
+	}
+
+	/* The buffers are reclaimed when stopping the source and sink. */
+	rate->has_pending = false;
+	rate->has_last = false;
+
+	if (rate->dropped || rate->repeated)
+		printf("Rate matching: %u frames dropped, %u frames repeated\n",
+		       rate->dropped, rate->repeated);
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer processing
+ */
+
+static void uvc_stream_source_process(void *d,
+				      struct video_source *src __attribute__((unused)),
+				      struct video_buffer *buffer)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_rate *rate = &stream->rate;
+
+	stream->metrics.stats.source_dequeued++;
+
+	/* Don't send corrupted frames, return the buffer to the source. */
+	if (buffer->error) {
+		stream->metrics.stats.source_errors++;
+		uvc_stream_recycle_buffer(stream, buffer);
+		return;
+	}
+
+	uvc_stream_metrics_capture(stream, buffer);
+	uvc_stream_release_last(stream);
+
+	/*
+	 * Until the sink is started, keep the most recent frame only, to avoid
+	 * sending stale frames first. Replacing it isn't a drop, the host
+	 * hasn't requested frames yet.
+	 */
+	if (stream->prewarmed) {
+		if (rate->has_pending)
+			uvc_stream_recycle_buffer(stream, &rate->pending);
+
+		rate->pending = *buffer;
+		rate->has_pending = true;
+		return;
+	}
+
+	if (!(rate->policy & UVC_STREAM_RATE_DROP) ||
+	    stream->depth.queued < UVC_STREAM_SINK_MAX_QUEUED) {
+		uvc_stream_queue_sink(stream, buffer);
+		return;
+	}
+
+	/*
+	 * The sink is saturated, keep the most recent frame only and drop the
+	 * previous pending one.
+	 */
+	if (rate->has_pending) {
+		rate->dropped++;
+		uvc_stream_recycle_buffer(stream, &rate->pending);
+	}
+
+	rate->pending = *buffer;
+	rate->has_pending = true;
+}
+
+static void uvc_stream_switch_complete(struct uvc_stream *stream);
+
+static void uvc_stream_uvc_process(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_depth *depth = &stream->depth;
+	struct uvc_stream_rate *rate = &stream->rate;
+	struct video_buffer buf;
+	int ret;
+
+	ret = uvc_stream_dequeue_sink(stream, &buf);
+	if (ret < 0)
+		return;
+
+	/*
+	 * When switching to a video source that allocates buffers, the buffers
+	 * are handed to the source once the sink has released them all.
+	 */
+	if (stream->draining) {
+		if (!depth->queued)
+			uvc_stream_switch_complete(stream);
+		return;
+	}
+
+	/* The sink has room for the pending frame. */
+	if (rate->has_pending) {
+		rate->has_pending = false;
+		uvc_stream_queue_sink(stream, &rate->pending);
+	}
+
+	/* Take the buffer out of circulation if the depth has been lowered. */
+	if (uvc_stream_circulating_buffers(stream) > depth->depth &&
+	    !video_buffer_queue_push(&depth->parked, &buf))
+		return;
+
+	if (uvc_stream_hold_last(stream, &buf))
+		return;
+
+	uvc_stream_recycle_buffer(stream, &buf);
+}
+
+/*
+ * Buffers are allocated when the stream is first started, and are kept across
+ * stop/start cycles as long as the format and number of buffers don't change.
+ * Restarting the stream then only requires queueing buffers and starting the
+ * source and sink, as hosts often toggle streaming.
+ */
+static void uvc_stream_free_buffers(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+
+	if (!stream->allocated)
+		return;
+
+	v4l2_free_buffers(sink);
+	video_source_free_buffers(stream->owner ? : stream->src);
+
+	stream->allocated = false;
+	stream->owner = NULL;
+}
+
+static int uvc_stream_alloc_buffers_alloc(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct video_buffer_set *buffers = NULL;
+	unsigned int nbufs;
+	int ret;
+
+	/*
+	 * Allocate and export the buffers on the source. In automatic mode,
+	 * allocate the maximum number of buffers, the ones that are not needed
+	 * are parked.
+	 */
+	nbufs = stream->depth.nbufs ? : UVC_STREAM_AUTO_MAX_BUFFERS;
+	ret = video_source_alloc_buffers(stream->src, nbufs);
+	if (ret < 0) {
+		printf("Failed to allocate source buffers: %s (%d)\n",
+		       strerror(-ret), -ret);
+		return ret;
+	}
+
+	ret = video_source_export_buffers(stream->src, &buffers);
+	if (ret < 0) {
+		printf("Failed to export buffers on source: %s (%d)\n",
+		       strerror(-ret), -ret);
+		goto error_free_source;
+	}
+
+	/* Allocate and import the buffers on the sink. */
+	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_DMABUF, buffers->nbufs);
+	if (ret < 0) {
+		printf("Failed to allocate sink buffers: %s (%d)\n",
+		       strerror(-ret), -ret);
+		goto error_free_source;
+	}
+
+	ret = v4l2_import_buffers(sink, buffers);
+	if (ret < 0) {
+		printf("Failed to import buffers on sink: %s (%d)\n",
+		       strerror(-ret), -ret);
+		goto error_free_sink;
+	}
+
+	/* The sink holds duplicates of the dmabuf handles. */
+	video_buffer_set_delete(buffers);
+
+	stream->owner = stream->src;
+
+	return 0;
+
+error_free_sink:
+	v4l2_free_buffers(sink);
+error_free_source:
+	video_source_free_buffers(stream->src);
+	if (buffers)
+		video_buffer_set_delete(buffers);
+	return ret;
+}
+
+static int uvc_stream_prepare_alloc(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	int ret;
+
+	if (!stream->allocated) {
+		ret = uvc_stream_alloc_buffers_alloc(stream);
+		if (ret < 0)
+			return ret;
+
+		stream->allocated = true;
+	}
+
+	uvc_stream_depth_reset(stream,
+			       stream->depth.nbufs ? : UVC_STREAM_DEFAULT_BUFFERS,
+			       sink->buffers.nbufs);
+
+	/* The source queues all its buffers when started. */
+	return video_source_stream_on(stream->src);
+}
+
+static int uvc_stream_alloc_buffers_no_alloc(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	int ret;
+
+	/* Allocate buffers on the sink. */
+	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_MMAP,
+				 stream->depth.nbufs ? : UVC_STREAM_DEFAULT_BUFFERS);
+	if (ret < 0) {
+		printf("Failed to allocate sink buffers: %s (%d)\n",
+		       strerror(-ret), -ret);
+		return ret;
+	}
+
+	/* mmap buffers. */
+	ret = v4l2_mmap_buffers(sink);
+	if (ret < 0) {
+		printf("Failed to query sink buffers: %s (%d)\n",
+				strerror(-ret), -ret);
+		v4l2_free_buffers(sink);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int uvc_stream_prepare_no_alloc(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	int ret;
+	unsigned int i;
+
+	if (!stream->allocated) {
+		ret = uvc_stream_alloc_buffers_no_alloc(stream);
+		if (ret < 0)
+			return ret;
+
+		stream->allocated = true;
+	}
+
+	uvc_stream_depth_reset(stream, sink->buffers.nbufs,
+			       stream->depth.nbufs ? sink->buffers.nbufs
+						   : UVC_STREAM_AUTO_MAX_BUFFERS);
+
+	/* Queue buffers to sink. */
+	for (i = 0; i < sink->buffers.nbufs; ++i) {
+		struct video_buffer buf = {
+			.index = i,
+			.size = sink->buffers.buffers[i].size,
+			.mem = sink->buffers.buffers[i].mem,
+		};
+
+		uvc_stream_fill_sync(stream, &buf);
+		ret = i ? uvc_stream_deliver(stream, &buf)
+			: uvc_stream_queue_sink(stream, &buf);
+		if (ret < 0)
+			return ret;
+	}
+
+	return video_source_stream_on(stream->src);
+}
+
+/*
+ * Prepare the stream for streaming: allocate the buffers, start the source and
+ * fill the first frames. Only the sink then needs to be started.
+ */
+static int uvc_stream_prepare(struct uvc_stream *stream)
+{
+	uvc_stream_metrics_reset(stream);
+	uvc_stream_rate_start(stream);
+	uvc_stream_pacing_start(stream);
+
+	if (uvc_stream_parallel_fill(stream))
+		uvc_stream_fill_start_workers(stream);
+
+	if (stream->src->ops->alloc_buffers)
+		return uvc_stream_prepare_alloc(stream);
+	else
+		return uvc_stream_prepare_no_alloc(stream);
+}
+
+/* Stop the source and sink, and reclaim all buffers. */
+static void uvc_stream_unprepare(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+
+	uvc_stream_rate_stop(stream);
+	uvc_stream_pacing_stop(stream);
+	uvc_stream_fill_flush(stream);
+
+	v4l2_stream_off(sink);
+	if (!stream->draining)
+		video_source_stream_off(stream->src);
+	stream->draining = false;
+	stream->prewarmed = false;
+}
+
+static int uvc_stream_start(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_rate *rate = &stream->rate;
+	int ret;
+
+	printf("Starting video stream%s.\n",
+	       stream->prewarmed ? " (pre-warmed)" :
+	       stream->allocated ? " (buffers reused)" : "");
+
+	stream->start_time = uvc_stream_clock();
+
+	if (!stream->prewarmed) {
+		ret = uvc_stream_prepare(stream);
+		if (ret < 0)
+			goto error;
+	}
+
+	stream->prewarmed = false;
+
+	/* Queue the most recent frame captured while pre-warmed. */
+	if (rate->has_pending) {
+		rate->has_pending = false;
+		uvc_stream_queue_sink(stream, &rate->pending);
+	}
+
+	ret = v4l2_stream_on(sink);
+	if (ret < 0)
+		goto error;
+
+	ret = events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
+			      uvc_stream_uvc_process, stream);
+	if (ret < 0)
+		goto error;
+
+	stream->sink_watch = ret;
+
+	uvc_stream_pacing_arm(stream);
+
+	return 0;
+
+error:
+	printf("Failed to start video stream: %s (%d)\n", strerror(-ret), -ret);
+	uvc_stream_unprepare(stream);
+	return ret;
+}
+
+static int uvc_stream_stop(struct uvc_stream *stream)
+{
+	printf("Stopping video stream.\n");
+
+	events_unwatch(stream->events, stream->sink_watch);
+	stream->sink_watch = -1;
+
+	uvc_stream_unprepare(stream);
+
+	/*
+	 * Keep the buffers for the next start, unless they're outdated, or
+	 * allocated by a video source that isn't the current one anymore.
+	 */
+	if (stream->realloc || (stream->owner && stream->owner != stream->src)) {
+		uvc_stream_free_buffers(stream);
+		stream->realloc = false;
+	}
+
+	return 0;
+}
+
+/* Undo pre-warming when the stream configuration changes before streaming. */
+static void uvc_stream_cancel_prewarm(struct uvc_stream *stream)
+{
+	if (!stream->prewarmed)
+		return;
+
+	printf("Cancelling pre-warmed video stream.\n");
+
+	uvc_stream_unprepare(stream);
+}
+
+/*
+ * Invalidate the buffers, they will be reallocated the next time the stream is
+ * started.
+ */
+static void uvc_stream_invalidate_buffers(struct uvc_stream *stream)
+{
+	if (stream->sink_watch >= 0)
+		stream->realloc = true;
+	else
+		uvc_stream_free_buffers(stream);
+}
+
+/* ---------------------------------------------------------------------------
+ * Video source switching
+ *
+ * The video source can be replaced while the stream is running, without
+ * stopping the sink. The new source is configured with the stream format and
+ * started before the current source is stopped, and the sources are swapped
+ * between two frames in a single event loop iteration. Frames already queued to
+ * the sink are transferred, and the buffers they occupy are handed to the new
+ * source when the sink releases them. All other buffers are handed to the new
+ * source immediately.
+ *
+ * Switching is limited by the sink buffer memory, which can't change while the
+ * sink is streaming. Sources that fill buffers can replace any source. When the
+ * sink uses buffers allocated by a video source, they are mapped to let other
+ * sources fill them, and the allocating source can later be restored. As that
+ * source needs all its buffers when it starts, the switch back completes once
+ * the sink has released all buffers, which leaves a gap of a few frames.
+ * Switching to any other source that allocates buffers requires stopping the
+ * stream.
+ */
+
+static void uvc_stream_attach_source(struct uvc_stream *stream,
+				     struct video_source *src)
+{
+	stream->src = src;
+
+	if (uvc_stream_async_source(stream))
+		video_source_set_buffer_handler(src, uvc_stream_source_process,
+						stream);
+
+	/* The controls set by the host are applied to the new source. */
+	uvc_set_video_source(stream->uvc, src);
+}
+
+/* Stop the current source, and release the buffers held for it. */
+static void uvc_stream_detach_source(struct uvc_stream *stream)
+{
+	uvc_stream_rate_stop(stream);
+	uvc_stream_pacing_stop(stream);
+	uvc_stream_fill_flush(stream);
+
+	video_source_stream_off(stream->src);
+}
+
+static int uvc_stream_configure_source(struct uvc_stream *stream,
+				       struct video_source *src)
+{
+	struct v4l2_pix_format fmt = stream->format;
+	int ret;
+
+	if (fmt.pixelformat) {
+		ret = video_source_set_format(src, &fmt);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (stream->interval) {
+		ret = video_source_set_frame_interval(src,
+						      stream->interval / 100);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Return the buffers that are neither queued to the sink nor parked. */
+static uint32_t uvc_stream_free_buffers_mask(struct uvc_stream *stream)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_depth *depth = &stream->depth;
+	unsigned int nbufs = sink->buffers.nbufs;
+	uint32_t mask;
+	unsigned int i;
+
+	mask = nbufs >= 32 ? UINT32_MAX : (1U << nbufs) - 1;
+	mask &= ~depth->queued_mask;
+
+	for (i = 0; i < depth->parked.count; ++i) {
+		unsigned int index = (depth->parked.first + i)
+				   % VIDEO_BUFFER_QUEUE_SIZE;
+
+		mask &= ~(1U << depth->parked.buffers[index].index);
+	}
+
+	return mask;
+}
+
+static int uvc_stream_switch_live(struct uvc_stream *stream,
+				  struct video_source *src)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	uint32_t mask;
+	unsigned int i;
+	int ret;
+
+	/* Let the new source fill the buffers allocated by another source. */
+	if (stream->owner) {
+		ret = v4l2_mmap_buffers(sink);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = uvc_stream_configure_source(stream, src);
+	if (ret < 0)
+		return ret;
+
+	/* Start the new source ahead, it has no buffer to fill yet. */
+	ret = video_source_stream_on(src);
+	if (ret < 0)
+		return ret;
+
+	uvc_stream_detach_source(stream);
+	uvc_stream_attach_source(stream, src);
+
+	uvc_stream_rate_start(stream);
+	uvc_stream_pacing_start(stream);
+	uvc_stream_pacing_arm(stream);
+	if (uvc_stream_parallel_fill(stream))
+		uvc_stream_fill_start_workers(stream);
+	else
+		uvc_stream_fill_stop_workers(stream);
+
+	mask = uvc_stream_free_buffers_mask(stream);
+
+	for (i = 0; i < sink->buffers.nbufs && i < 32; ++i) {
+		struct video_buffer buf = {
+			.index = i,
+			.size = sink->buffers.buffers[i].size,
+			.mem = sink->buffers.buffers[i].mem,
+			.dmabuf = sink->buffers.buffers[i].dmabuf,
+		};
+
+		if (mask & (1U << i))
+			uvc_stream_recycle_buffer(stream, &buf);
+	}
+
+	return 0;
+}
+
+static void uvc_stream_switch_complete(struct uvc_stream *stream)
+{
+	int ret;
+
+	stream->draining = false;
+
+	/* All buffers return to circulation, the source queues them all. */
+	video_buffer_queue_init(&stream->depth.parked);
+	stream->depth.empty_since = 0;
+
+	uvc_stream_rate_start(stream);
+
+	ret = video_source_stream_on(stream->src);
+	if (ret < 0)
+		printf("Failed to start video source: %s (%d)\n",
+		       strerror(-ret), -ret);
+}
+
+static void uvc_stream_switch_to_owner(struct uvc_stream *stream)
+{
+	uvc_stream_detach_source(stream);
+	uvc_stream_attach_source(stream, stream->owner);
+
+	stream->draining = true;
+
+	if (!stream->depth.queued)
+		uvc_stream_switch_complete(stream);
+}
+
+/* Switch sources while the stream is stopped, buffers are reallocated if needed. */
+static int uvc_stream_switch_idle(struct uvc_stream *stream,
+				  struct video_source *src)
+{
+	int ret;
+
+	if (stream->owner || src->ops->alloc_buffers)
+		uvc_stream_free_buffers(stream);
+
+	ret = uvc_stream_configure_source(stream, src);
+	if (ret < 0)
+		return ret;
+
+	uvc_stream_attach_source(stream, src);
+
+	return 0;
+}
+
+int uvc_stream_switch_video_source(struct uvc_stream *stream,
+				   struct video_source *src)
+{
+	if (src == stream->src)
+		return 0;
+
+	if (stream->sink_watch < 0) {
+		uvc_stream_cancel_prewarm(stream);
+		return uvc_stream_switch_idle(stream, src);
+	}
+
+	if (stream->draining)
+		return -EBUSY;
+
+	if (src->ops->alloc_buffers) {
+		if (src != stream->owner) {
+			printf("Can't switch to a source that allocates buffers while streaming\n");
+			return -EBUSY;
+		}
+
+		uvc_stream_switch_to_owner(stream);
+		return 0;
+	}
+
+	return uvc_stream_switch_live(stream, src);
+}
+
+int uvc_stream_reload_video_source(struct uvc_stream *stream,
+				   struct video_source *src)
+{
+	struct uvc_stream_fill *fill = &stream->fill;
+	int ret;
+
+	if (src != stream->src || !fill->nthreads)
+		return video_source_reload(src);
+
+	/*
+	 * Wait for the buffers being filled, and keep the workers from filling
+	 * the pending buffers until the source has reloaded.
+	 */
+	pthread_mutex_lock(&fill->lock);
+	fill->paused = true;
+	while (fill->busy)
+		pthread_cond_wait(&fill->idle, &fill->lock);
+	pthread_mutex_unlock(&fill->lock);
+
+	ret = video_source_reload(src);
+
+	pthread_mutex_lock(&fill->lock);
+	fill->paused = false;
+	pthread_cond_broadcast(&fill->cond);
+	pthread_mutex_unlock(&fill->lock);
+
+	return ret;
+}
+
+void uvc_stream_enable(struct uvc_stream *stream, int enable)
+{
+	if (enable)
+		uvc_stream_start(stream);
+	else
+		uvc_stream_stop(stream);
+}
+
+int uvc_stream_set_format(struct uvc_stream *stream,
+			  const struct v4l2_pix_format *format)
+{
+	struct v4l2_pix_format fmt = *format;
+	int ret;
+
+	/*
+	 * Hosts commit the format every time they start streaming. Keep the
+	 * buffers if it hasn't changed, the device format is then already
+	 * set and can't be set again while buffers are allocated.
+	 */
+	if (stream->allocated && !stream->realloc &&
+	    format->pixelformat == stream->format.pixelformat &&
+	    format->width == stream->format.width &&
+	    format->height == stream->format.height &&
+	    format->sizeimage == stream->format.sizeimage)
+		return 0;
+
+	printf("Setting format to 0x%08x %ux%u\n",
+		format->pixelformat, format->width, format->height);
+
+	uvc_stream_cancel_prewarm(stream);
+	uvc_stream_invalidate_buffers(stream);
+
+	stream->format = *format;
+
+	/*
+	 * The size of compressed frames is only set for compressed formats, to
+	 * the worst case advertised to the host. When the video source reports
+	 * a smaller worst case, size the UVC device buffers accordingly.
+	 */
+	if (format->sizeimage) {
+		struct v4l2_pix_format sink_fmt = *format;
+
+		ret = video_source_set_format(stream->src, &fmt);
+		if (ret < 0)
+			return ret;
+
+		if (fmt.sizeimage && fmt.sizeimage < sink_fmt.sizeimage) {
+			printf("Sizing buffers for %u bytes frames\n",
+			       fmt.sizeimage);
+			sink_fmt.sizeimage = fmt.sizeimage;
+		}
+
+		return uvc_set_format(stream->uvc, &sink_fmt);
+	}
+
+	ret = uvc_set_format(stream->uvc, &fmt);
+	if (ret < 0)
+		return ret;
+
+	return video_source_set_format(stream->src, &fmt);
+}
+
+int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps)
 {
-	struct video_source *src;
-	struct uvc_device *uvc;
+	if (!fps)
+		return -EINVAL;
 
-	struct events *events;
-};
+	return uvc_stream_set_frame_interval(stream, 10000000 / fps);
+}
+
+int uvc_stream_set_frame_interval(struct uvc_stream *stream,
+				  unsigned int interval)
+{
+	unsigned int mfps;
+
+	if (!interval)
+		return -EINVAL;
+
+	mfps = (10000000000ULL + interval / 2) / interval;
+
+	printf("=== Setting frame interval to %u.%04u ms (%u.%03u fps)\n",
+	       interval / 10000, interval % 10000, mfps / 1000, mfps % 1000);
+
+	/* The source rate and frame pacing are set when preparing the stream. */
+	if (stream->interval != interval * 100ULL)
+		uvc_stream_cancel_prewarm(stream);
+
+	stream->interval = interval * 100ULL;
+
+	return video_source_set_frame_interval(stream->src, interval);
+}
 
 /* ---------------------------------------------------------------------------
- * Video streaming
+ * Still image capture
+ *
+ * Still images are captured from a dedicated video source, typically the full
+ * resolution output of the sensor, into a buffer separate from the stream
+ * buffers. The stream keeps running from its own source and buffers. Sources
+ * that fill buffers fill the still buffer directly. Frames from sources that
+ * allocate buffers are copied to the still buffer through a mapping of the
+ * exported dmabufs, bracketed by dmabuf CPU access synchronization. The source
+ * buffers are only allocated and mapped for the duration of the capture.
  */
 
-static void uvc_stream_source_process(void *d,
-				      struct video_source *src __attribute__((unused)),
-				      struct video_buffer *buffer)
+static int uvc_stream_still_alloc(struct uvc_stream_still *still)
 {
-	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	unsigned int size = still->format.sizeimage;
+	void *mem;
+
+	if (!size)
+		size = still->format.bytesperline * still->format.height;
+	if (!size)
+		size = still->format.width * still->format.height * 2;
 
-	v4l2_queue_buffer(sink, buffer);
+	/* The buffer is kept for the next captures. */
+	if (size <= still->buf.size)
+		return 0;
+
+	mem = malloc(size);
+	if (!mem)
+		return -ENOMEM;
+
+	free(still->buf.mem);
+	still->buf.mem = mem;
+	still->buf.dmabuf = -1;
+	still->buf.size = size;
+
+	return 0;
 }
 
-static void uvc_stream_uvc_process(void *d)
+/* Unmap and release the buffers exported by the still image source. */
+static void uvc_stream_still_release(struct uvc_stream_still *still)
 {
-	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	struct video_buffer buf;
-	int ret;
+	unsigned int i;
 
-	ret = v4l2_dequeue_buffer(sink, &buf);
-	if (ret < 0)
+	if (!still->buffers)
 		return;
 
-	video_source_queue_buffer(stream->src, &buf);
+	for (i = 0; i < still->buffers->nbufs; ++i) {
+		struct video_buffer *buf = &still->buffers->buffers[i];
+
+		if (buf->mem)
+			munmap(buf->mem, buf->size);
+	}
+
+	video_buffer_set_delete(still->buffers);
+	still->buffers = NULL;
 }
 
-static void uvc_stream_uvc_process_no_buf(void *d)
+static int uvc_stream_still_map(struct uvc_stream_still *still)
 {
-	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	struct video_buffer buf;
-	int ret;
+	unsigned int i;
 
-	ret = v4l2_dequeue_buffer(sink, &buf);
-	if (ret < 0)
-		return;
+	for (i = 0; i < still->buffers->nbufs; ++i) {
+		struct video_buffer *buf = &still->buffers->buffers[i];
+		void *mem;
+
+		mem = mmap(NULL, buf->size, PROT_READ, MAP_SHARED,
+			   buf->dmabuf, 0);
+		if (mem == MAP_FAILED) {
+			printf("Failed to map still image buffer %u: %s (%d)\n",
+			       i, strerror(errno), errno);
+			return -errno;
+		}
 
-	video_source_fill_buffer(stream->src, &buf);
+		buf->mem = mem;
+	}
 
-	v4l2_queue_buffer(sink, &buf);
+	return 0;
 }
 
+static void uvc_stream_still_sync(const struct video_buffer *buf,
+				  uint64_t flags)
+{
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_READ,
+	};
+
+	if (ioctl(buf->dmabuf, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		printf("Failed to synchronize still image buffer: %s (%d)\n",
+		       strerror(errno), errno);
+}
 
-static int uvc_stream_start_alloc(struct uvc_stream *stream)
+static void uvc_stream_still_stop(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	struct video_buffer_set *buffers = NULL;
-	int ret;
+	struct uvc_stream_still *still = &stream->still;
 
-	/* Allocate and export the buffers on the source. */
-	ret = video_source_alloc_buffers(stream->src, 4);
-	if (ret < 0) {
-		printf("Failed to allocate source buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
-		return ret;
+	if (still->timer_watch < 0)
+		return;
+
+	timer_disarm(still->timer);
+	events_unwatch(stream->events, still->timer_watch);
+	still->timer_watch = -1;
+
+	if (still->buffers) {
+		video_source_stream_off(still->src);
+		uvc_stream_still_release(still);
+		video_source_free_buffers(still->src);
 	}
+}
 
-	ret = video_source_export_buffers(stream->src, &buffers);
-	if (ret < 0) {
-		printf("Failed to export buffers on source: %s (%d)\n",
-		       strerror(-ret), -ret);
-		goto error_free_source;
+static void uvc_stream_still_complete(struct uvc_stream *stream)
+{
+	struct uvc_stream_still *still = &stream->still;
+
+	uvc_stream_still_stop(stream);
+
+	if (still->buf.error) {
+		printf("Failed to capture %ux%u still image\n",
+		       still->format.width, still->format.height);
+	} else {
+		printf("Captured %ux%u still image, %u bytes\n",
+		       still->format.width, still->format.height,
+		       still->buf.bytesused);
+
+		if (still->handler)
+			still->handler(still->handler_data, &still->format,
+				       still->buf.mem, still->buf.bytesused);
 	}
+}
 
-	/* Allocate and import the buffers on the sink. */
-	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_DMABUF, buffers->nbufs);
-	if (ret < 0) {
-		printf("Failed to allocate sink buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
-		goto error_free_source;
+static void uvc_stream_still_work(void *d)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_still *still = &stream->still;
+
+	if (!still->buffers) {
+		video_source_fill_buffer(still->src, &still->buf);
+		still->captured = true;
 	}
 
-	ret = v4l2_import_buffers(sink, buffers);
-	if (ret < 0) {
-		printf("Failed to import buffers on sink: %s (%d)\n",
-		       strerror(-ret), -ret);
-		goto error_free_sink;
+	if (still->captured)
+		uvc_stream_still_complete(stream);
+}
+
+static void uvc_stream_still_process(void *d, struct video_source *src,
+				     struct video_buffer *buffer)
+{
+	struct uvc_stream *stream = d;
+	struct uvc_stream_still *still = &stream->still;
+	const struct video_buffer *exported;
+
+	/* Skip frames captured with errors, and frames after the still. */
+	if (still->captured || buffer->error || !still->buffers ||
+	    buffer->index >= still->buffers->nbufs) {
+		video_source_queue_buffer(src, buffer);
+		return;
 	}
 
-	/* Start the source and sink. */
-	video_source_stream_on(stream->src);
-	v4l2_stream_on(sink);
+	exported = &still->buffers->buffers[buffer->index];
 
-	events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
-			uvc_stream_uvc_process, stream);
+	still->buf.bytesused = min(buffer->bytesused, still->buf.size);
+	still->buf.error = buffer->bytesused > still->buf.size;
+	still->buf.timestamp = buffer->timestamp;
 
-	return 0;
+	uvc_stream_still_sync(exported, DMA_BUF_SYNC_START);
+	memcpy(still->buf.mem, exported->mem, still->buf.bytesused);
+	uvc_stream_still_sync(exported, DMA_BUF_SYNC_END);
 
-error_free_sink:
-	v4l2_free_buffers(sink);
-error_free_source:
-	video_source_free_buffers(stream->src);
-	if (buffers)
-		video_buffer_set_delete(buffers);
-	return ret;
+	still->captured = true;
+
+	video_source_queue_buffer(src, buffer);
+
+	/* Stop the source from the event loop, outside of its handler. */
+	timer_arm_once(still->timer, 0);
 }
 
-static int uvc_stream_start_no_alloc(struct uvc_stream *stream)
+static int uvc_stream_still_start(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_still *still = &stream->still;
+	struct video_source *src = still->src;
+	struct video_buffer_set *buffers;
 	int ret;
-	unsigned int i;
 
-	/* Allocate buffers on the sink. */
-	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_MMAP, 4);
-	if (ret < 0) {
-		printf("Failed to allocate sink buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
-		return ret;
-	}
+	video_source_set_buffer_handler(src, uvc_stream_still_process, stream);
 
-	/* mmap buffers. */
-	ret = v4l2_mmap_buffers(sink);
-	if (ret < 0) {
-		printf("Failed to query sink buffers: %s (%d)\n",
-				strerror(-ret), -ret);
+	ret = video_source_alloc_buffers(src, UVC_STREAM_STILL_BUFFERS);
+	if (ret < 0)
 		return ret;
-	}
 
-	/* Queue buffers to sink. */
-	for (i = 0; i < sink->buffers.nbufs; ++i) {
-		struct video_buffer buf = {
-			.index = i,
-			.size = sink->buffers.buffers[i].size,
-			.mem = sink->buffers.buffers[i].mem,
-		};
+	ret = video_source_export_buffers(src, &buffers);
+	if (ret < 0)
+		goto error;
 
-		video_source_fill_buffer(stream->src, &buf);
-		ret = v4l2_queue_buffer(sink, &buf);
-		if (ret < 0)
-			return ret;
-	}
+	still->buffers = buffers;
 
-	/* Start the source and sink. */
-	video_source_stream_on(stream->src);
-	ret = v4l2_stream_on(sink);
+	ret = uvc_stream_still_map(still);
 	if (ret < 0)
-		return ret;
+		goto error;
 
-	events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
-			uvc_stream_uvc_process_no_buf, stream);
+	ret = video_source_stream_on(src);
+	if (ret < 0)
+		goto error;
 
 	return 0;
+
+error:
+	uvc_stream_still_release(still);
+	video_source_free_buffers(src);
+	return ret;
 }
 
-static int uvc_stream_start(struct uvc_stream *stream)
+int uvc_stream_capture_still(struct uvc_stream *stream,
+			     const struct v4l2_pix_format *format)
 {
-	printf("Starting video stream.\n");
+	struct uvc_stream_still *still = &stream->still;
+	struct video_source *src = still->src;
+	int ret;
 
-	if (stream->src->ops->alloc_buffers)
-		return uvc_stream_start_alloc(stream);
-	else
-		return uvc_stream_start_no_alloc(stream);
-}
+	if (!src)
+		return -ENODEV;
 
-static int uvc_stream_stop(struct uvc_stream *stream)
-{
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	if (!src->ops->fill_buffer &&
+	    (!src->ops->alloc_buffers || !src->ops->export_buffers))
+		return -ENOTSUP;
 
-	printf("Stopping video stream.\n");
+	if (still->timer_watch >= 0)
+		return -EBUSY;
 
-	events_unwatch_fd(stream->events, sink->fd, EVENT_WRITE);
+	still->format = *format;
+	if (!still->format.pixelformat)
+		still->format.pixelformat = stream->format.pixelformat;
 
-	v4l2_stream_off(sink);
-	video_source_stream_off(stream->src);
+	ret = video_source_set_format(src, &still->format);
+	if (ret < 0)
+		return ret;
 
-	v4l2_free_buffers(sink);
-	video_source_free_buffers(stream->src);
+	ret = uvc_stream_still_alloc(still);
+	if (ret < 0)
+		return ret;
 
-	return 0;
-}
+	still->buf.bytesused = 0;
+	still->buf.error = false;
+	still->captured = false;
 
-void uvc_stream_enable(struct uvc_stream *stream, int enable)
-{
-	if (enable)
-		uvc_stream_start(stream);
-	else
-		uvc_stream_stop(stream);
-}
+	ret = events_add_timer(stream->events, still->timer,
+			       uvc_stream_still_work, stream);
+	if (ret < 0)
+		return ret;
 
-int uvc_stream_set_format(struct uvc_stream *stream,
-			  const struct v4l2_pix_format *format)
-{
-	struct v4l2_pix_format fmt = *format;
-	int ret;
+	still->timer_watch = ret;
 
-	printf("Setting format to 0x%08x %ux%u\n",
-		format->pixelformat, format->width, format->height);
+	/*
+	 * Fill the buffer from the event loop, outside of the caller, or wait
+	 * for the first frame from the source.
+	 */
+	if (src->ops->fill_buffer) {
+		timer_arm_once(still->timer, 0);
+		return 0;
+	}
 
-	ret = uvc_set_format(stream->uvc, &fmt);
-	if (ret < 0)
+	ret = uvc_stream_still_start(stream);
+	if (ret < 0) {
+		events_unwatch(stream->events, still->timer_watch);
+		still->timer_watch = -1;
 		return ret;
+	}
 
-	return video_source_set_format(stream->src, &fmt);
+	return 0;
 }
 
-int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps)
+void uvc_stream_cancel_still(struct uvc_stream *stream)
+{
+	if (stream->still.timer_watch < 0)
+		return;
+
+	printf("Still image capture aborted\n");
+	uvc_stream_still_stop(stream);
+}
+
+void uvc_stream_set_still_source(struct uvc_stream *stream,
+				 struct video_source *src,
+				 uvc_stream_still_handler_t handler, void *data)
 {
-	printf("=== Setting frame rate to %u fps\n", fps);
-	return video_source_set_frame_rate(stream->src, fps);
+	uvc_stream_cancel_still(stream);
+
+	stream->still.src = src;
+	stream->still.handler = handler;
+	stream->still.handler_data = data;
 }
 
 /* ---------------------------------------------------------------------------
@@ -249,6 +2079,36 @@ struct uvc_stream *uvc_stream_new(const char *uvc_device)
 		return NULL;
 
 	memset(stream, 0, sizeof(*stream));
+	stream->sink_watch = -1;
+	stream->depth.nbufs = UVC_STREAM_DEFAULT_BUFFERS;
+	stream->rate.policy = UVC_STREAM_RATE_DROP | UVC_STREAM_RATE_REPEAT;
+	stream->rate.timer_watch = -1;
+	stream->pacing.timer_watch = -1;
+	stream->still.timer_watch = -1;
+
+	pthread_mutex_init(&stream->fill.lock, NULL);
+	pthread_cond_init(&stream->fill.cond, NULL);
+	pthread_cond_init(&stream->fill.idle, NULL);
+
+	stream->rate.timer = timer_new();
+	if (stream->rate.timer == NULL)
+		goto error;
+
+	stream->pacing.timer = timer_new();
+	if (stream->pacing.timer == NULL)
+		goto error;
+
+	stream->still.timer = timer_new();
+	if (stream->still.timer == NULL)
+		goto error;
+
+	stream->metrics.interval = histogram_new();
+	stream->metrics.latency = histogram_new();
+	stream->metrics.queue_latency = histogram_new();
+	stream->metrics.transfer_latency = histogram_new();
+	if (!stream->metrics.interval || !stream->metrics.latency ||
+	    !stream->metrics.queue_latency || !stream->metrics.transfer_latency)
+		goto error;
 
 	stream->uvc = uvc_open(uvc_device, stream);
 	if (stream->uvc == NULL)
@@ -257,6 +2117,19 @@ struct uvc_stream *uvc_stream_new(const char *uvc_device)
 	return stream;
 
 error:
+	histogram_destroy(stream->metrics.transfer_latency);
+	histogram_destroy(stream->metrics.queue_latency);
+	histogram_destroy(stream->metrics.latency);
+	histogram_destroy(stream->metrics.interval);
+	if (stream->still.timer)
+		timer_destroy(stream->still.timer);
+	if (stream->pacing.timer)
+		timer_destroy(stream->pacing.timer);
+	if (stream->rate.timer)
+		timer_destroy(stream->rate.timer);
+	pthread_cond_destroy(&stream->fill.idle);
+	pthread_cond_destroy(&stream->fill.cond);
+	pthread_mutex_destroy(&stream->fill.lock);
 	free(stream);
 	return NULL;
 }
@@ -266,7 +2139,22 @@ void uvc_stream_delete(struct uvc_stream *stream)
 	if (stream == NULL)
 		return;
 
+	uvc_stream_cancel_prewarm(stream);
+	uvc_stream_cancel_still(stream);
+	uvc_stream_fill_stop_workers(stream);
+	uvc_stream_free_buffers(stream);
 	uvc_close(stream->uvc);
+	histogram_destroy(stream->metrics.transfer_latency);
+	histogram_destroy(stream->metrics.queue_latency);
+	histogram_destroy(stream->metrics.latency);
+	histogram_destroy(stream->metrics.interval);
+	timer_destroy(stream->still.timer);
+	timer_destroy(stream->pacing.timer);
+	timer_destroy(stream->rate.timer);
+	pthread_cond_destroy(&stream->fill.idle);
+	pthread_cond_destroy(&stream->fill.cond);
+	pthread_mutex_destroy(&stream->fill.lock);
+	free(stream->still.buf.mem);
 
 	free(stream);
 }
@@ -284,12 +2172,110 @@ void uvc_stream_set_event_handler(struct uvc_stream *stream,
 	stream->events = events;
 }
 
+void uvc_stream_set_buffer_count(struct uvc_stream *stream, unsigned int count)
+{
+	if (count)
+		count = clamp_t(unsigned int, count, UVC_STREAM_MIN_BUFFERS,
+				VIDEO_BUFFER_QUEUE_SIZE);
+
+	if (count != stream->depth.nbufs)
+		uvc_stream_invalidate_buffers(stream);
+
+	stream->depth.nbufs = count;
+}
+
+void uvc_stream_set_rate_policy(struct uvc_stream *stream, unsigned int policy)
+{
+	stream->rate.policy = policy;
+}
+
+void uvc_stream_set_fill_workers(struct uvc_stream *stream, unsigned int count)
+{
+	stream->fill.workers = min_t(unsigned int, count,
+				     UVC_STREAM_MAX_FILL_WORKERS);
+}
+
+void uvc_stream_get_stats(struct uvc_stream *stream,
+			  struct uvc_stream_stats *stats)
+{
+	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
+	struct uvc_stream_metrics *metrics = &stream->metrics;
+	unsigned int held;
+
+	*stats = metrics->stats;
+	stats->dropped = stream->rate.dropped;
+	stats->repeated = stream->rate.repeated;
+	stats->missed_deadlines = stream->pacing.missed;
+
+	stats->buffers = sink->buffers.nbufs;
+	stats->sink_buffers = 0;
+	stats->source_buffers = 0;
+
+	if (stream->sink_watch >= 0) {
+		held = stream->depth.parked.count + stream->rate.has_pending
+		     + stream->rate.has_last + stream->pacing.ready.count;
+
+		stats->sink_buffers = stream->depth.queued;
+		if (stats->buffers > stats->sink_buffers + held)
+			stats->source_buffers = stats->buffers
+					      - stats->sink_buffers - held;
+	}
+
+	histogram_summarize(metrics->interval, &stats->interval);
+	histogram_summarize(metrics->latency, &stats->latency);
+	histogram_summarize(metrics->queue_latency, &stats->queue_latency);
+	histogram_summarize(metrics->transfer_latency,
+			    &stats->transfer_latency);
+}
+
+void uvc_stream_set_prewarm(struct uvc_stream *stream, int enable)
+{
+	stream->prewarm = enable;
+
+	if (!enable)
+		uvc_stream_cancel_prewarm(stream);
+}
+
+int uvc_stream_prewarm(struct uvc_stream *stream)
+{
+	uint64_t start;
+	int ret;
+
+	if (!stream->prewarm || stream->prewarmed || stream->sink_watch >= 0)
+		return 0;
+
+	start = uvc_stream_clock();
+
+	ret = uvc_stream_prepare(stream);
+	if (ret < 0) {
+		printf("Failed to pre-warm video stream: %s (%d)\n",
+		       strerror(-ret), -ret);
+		uvc_stream_unprepare(stream);
+		return ret;
+	}
+
+	stream->prewarmed = true;
+
+	printf("Video stream pre-warmed in %llu us\n",
+	       (unsigned long long)(uvc_stream_clock() - start) / 1000);
+
+	return 0;
+}
+
+void uvc_stream_set_latency_threshold(struct uvc_stream *stream,
+				      uint64_t threshold)
+{
+	stream->metrics.threshold = threshold;
+}
+
 void uvc_stream_set_video_source(struct uvc_stream *stream,
 				 struct video_source *src)
 {
 	stream->src = src;
 
-	if (stream->src->ops->alloc_buffers)
+	if (stream->src->ops->alloc_buffers || stream->src->ops->queue_buffer)
 		video_source_set_buffer_handler(src, uvc_stream_source_process,
 						stream);
+
+	uvc_set_video_source(stream->uvc, src);
 }
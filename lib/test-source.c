@@ -59,8 +59,8 @@ static int test_source_set_format(struct video_source *s,
 	return 0;
 }
 
-static int test_source_set_frame_rate(struct video_source *s __attribute__((unused)),
-				      unsigned int fps __attribute__((unused)))
+static int test_source_set_frame_interval(struct video_source *s __attribute__((unused)),
+					  unsigned int interval __attribute__((unused)))
 {
 	return 0;
 }
@@ -114,9 +114,10 @@ static void test_source_fill_buffer(struct video_source *s,
 }
 
 static const struct video_source_ops test_source_ops = {
+	.flags = VIDEO_SOURCE_FILL_REENTRANT,
 	.destroy = test_source_destroy,
 	.set_format = test_source_set_format,
-	.set_frame_rate = test_source_set_frame_rate,
+	.set_frame_interval = test_source_set_frame_interval,
 	.free_buffers = test_source_free_buffers,
 	.stream_on = test_source_stream_on,
 	.stream_off = test_source_stream_off,
@@ -8,6 +8,8 @@
  */
 
 #include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,7 +33,7 @@ struct timer *timer_new(void)
 
         memset(timer, 0, sizeof(*timer));
 
-        timer->fd = timerfd_create(CLOCK_REALTIME, 0);
+        timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
         if (timer->fd < 0) {
 		fprintf(stderr, "failed to create timer: %s (%d)\n",
 			strerror(errno), errno);
@@ -48,10 +50,14 @@ err_free_timer:
 
 void timer_set_fps(struct timer *timer, int fps)
 {
-	int ns_per_frame = 1000000000 / fps;
+	timer_set_interval(timer, 1000000000 / fps);
+}
 
-	timer->settings.it_value.tv_nsec = ns_per_frame;
-	timer->settings.it_interval.tv_nsec = ns_per_frame;
+void timer_set_interval(struct timer *timer, uint64_t ns)
+{
+	timer->settings.it_value.tv_sec = ns / 1000000000;
+	timer->settings.it_value.tv_nsec = ns % 1000000000;
+	timer->settings.it_interval = timer->settings.it_value;
 }
 
 int timer_arm(struct timer *timer)
@@ -66,6 +72,53 @@ int timer_arm(struct timer *timer)
         return ret;
 }
 
+int timer_arm_once(struct timer *timer, uint64_t ns)
+{
+	struct itimerspec settings = {
+		.it_value = {
+			.tv_sec = ns / 1000000000,
+			.tv_nsec = ns % 1000000000,
+		},
+	};
+	int ret;
+
+	/* A zero expiration time would disarm the timer. */
+	if (!ns)
+		settings.it_value.tv_nsec = 1;
+
+	ret = timerfd_settime(timer->fd, 0, &settings, NULL);
+	if (ret)
+		fprintf(stderr, "failed to change timer settings: %s (%d)\n",
+			strerror(errno), errno);
+
+	return ret;
+}
+
+int timer_arm_at(struct timer *timer, uint64_t deadline)
+{
+	struct itimerspec settings = {
+		.it_value = {
+			.tv_sec = deadline / 1000000000,
+			.tv_nsec = deadline % 1000000000,
+		},
+	};
+	int ret;
+
+	/*
+	 * A zero expiration time would disarm the timer, while deadlines in the
+	 * past expire immediately.
+	 */
+	if (!deadline)
+		settings.it_value.tv_nsec = 1;
+
+	ret = timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &settings, NULL);
+	if (ret)
+		fprintf(stderr, "failed to change timer settings: %s (%d)\n",
+			strerror(errno), errno);
+
+	return ret;
+}
+
 int timer_disarm(struct timer *timer)
 {
 	static const struct itimerspec disable_settings = {
@@ -84,9 +137,31 @@ int timer_disarm(struct timer *timer)
 
 void timer_wait(struct timer *timer)
 {
-        char read_buf[8];
+	struct pollfd pfd = {
+		.fd = timer->fd,
+		.events = POLLIN,
+	};
+
+	/* The file descriptor is non-blocking, wait for it to be readable. */
+	poll(&pfd, 1, -1);
+	timer_expirations(timer);
+}
+
+int timer_fd(struct timer *timer)
+{
+	return timer->fd;
+}
+
+unsigned int timer_expirations(struct timer *timer)
+{
+	uint64_t expirations;
+	ssize_t ret;
+
+	ret = read(timer->fd, &expirations, sizeof(expirations));
+	if (ret != sizeof(expirations))
+		return 0;
 
-        read(timer->fd, read_buf, 8);
+	return expirations;
 }
 
 void timer_destroy(struct timer *timer)
@@ -18,23 +18,57 @@
 #include <sys/ioctl.h>
 
 #include "configfs.h"
+#include "controls.h"
 #include "events.h"
 #include "stream.h"
 #include "tools.h"
 #include "uvc.h"
 #include "v4l2.h"
 
+/*
+ * struct uvc_probe_frame - Precomputed probe responses for a frame
+ * @num_intervals: Number of entries in the intervals and controls arrays
+ * @intervals: Frame intervals, sorted in ascending order
+ * @select: Index of the response to a request for an interval longer than
+ *	intervals[i - 1] and not longer than intervals[i], with num_intervals + 1
+ *	entries
+ * @controls: Responses for each interval
+ */
+struct uvc_probe_frame {
+	unsigned int num_intervals;
+	unsigned int *intervals;
+	unsigned int *select;
+	struct uvc_streaming_control *controls;
+};
+
+/*
+ * struct uvc_probe_format - Precomputed probe responses for a format
+ * @num_frames: Number of entries in the frames array
+ * @frames: Responses for each frame
+ */
+struct uvc_probe_format {
+	unsigned int num_frames;
+	struct uvc_probe_frame *frames;
+};
+
 struct uvc_device
 {
 	struct v4l2_device *vdev;
 
 	struct uvc_stream *stream;
 	struct uvc_function_config *fc;
+	struct video_source *src;
+	struct uvc_controls *controls;
+	enum usb_device_speed speed;
 
 	struct uvc_streaming_control probe;
 	struct uvc_streaming_control commit;
 
+	unsigned int num_probe_formats;
+	struct uvc_probe_format *probe_formats;
+
 	int control;
+	unsigned int control_unit;
 
 	unsigned int fcc;
 	unsigned int width;
@@ -91,6 +125,8 @@ static const char *pu_control_name(uint8_t cs)
         return "UNKNOWN";
 }
 
+static void uvc_probe_table_free(struct uvc_device *dev);
+
 struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream)
 {
 	struct uvc_device *dev;
@@ -113,24 +149,129 @@ struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream)
 
 void uvc_close(struct uvc_device *dev)
 {
+	uvc_controls_delete(dev->controls);
+	uvc_probe_table_free(dev);
 	v4l2_close(dev->vdev);
 	dev->vdev = NULL;
 
 	free(dev);
 }
 
+/* ---------------------------------------------------------------------------
+ * Bandwidth
+ *
+ * An isochronous endpoint transfers up to wMaxPacketSize bytes (including the
+ * high-bandwidth multiplier) per burst, with bMaxBurst + 1 bursts per service
+ * interval on super-speed and a single one at lower speeds, as bMaxBurst only
+ * applies to the super-speed endpoint companion descriptor. The service
+ * interval is 2^(bInterval - 1) microframes of 125us, full-speed operation
+ * isn't taken into account. Each transfer starts with a UVC payload header.
+ *
+ * The functions below only depend on their arguments, and can be tested with
+ * synthetic configurations.
+ */
+
+#define UVC_PAYLOAD_HEADER_SIZE		12
+#define UVC_MICROFRAMES_PER_SECOND	8000
+
+uint32_t uvc_payload_transfer_size(const struct uvc_function_config_endpoint *ep,
+				   enum usb_device_speed speed)
+{
+	if (speed < USB_SPEED_SUPER)
+		return ep->wMaxPacketSize;
+
+	return ep->wMaxPacketSize * (ep->bMaxBurst + 1);
+}
+
+uint64_t uvc_endpoint_bandwidth(const struct uvc_function_config_endpoint *ep,
+				enum usb_device_speed speed)
+{
+	unsigned int size = uvc_payload_transfer_size(ep, speed);
+	unsigned int interval = clamp_t(unsigned int, ep->bInterval, 1U, 16U);
+
+	if (size <= UVC_PAYLOAD_HEADER_SIZE)
+		return 0;
+
+	return ((uint64_t)(size - UVC_PAYLOAD_HEADER_SIZE)
+		* UVC_MICROFRAMES_PER_SECOND) >> (interval - 1);
+}
+
+bool uvc_frame_fits_bandwidth(const struct uvc_function_config_endpoint *ep,
+			      enum usb_device_speed speed,
+			      unsigned int frame_size, unsigned int interval)
+{
+	/* Frame intervals are expressed in 100ns units. */
+	return (uint64_t)frame_size * 10000000
+	     <= uvc_endpoint_bandwidth(ep, speed) * interval;
+}
+
+unsigned int
+uvc_select_frame_interval(const struct uvc_function_config_endpoint *ep,
+			  enum usb_device_speed speed,
+			  const struct uvc_function_config_frame *frame,
+			  unsigned int frame_size, unsigned int ival)
+{
+	unsigned int slowest = 0;
+	unsigned int above = 0;
+	unsigned int below = 0;
+	unsigned int i;
+
+	for (i = 0; i < frame->num_intervals; ++i) {
+		unsigned int interval = frame->intervals[i];
+
+		slowest = max(slowest, interval);
+
+		if (frame_size &&
+		    !uvc_frame_fits_bandwidth(ep, speed, frame_size, interval))
+			continue;
+
+		if (interval >= ival) {
+			if (!above || interval < above)
+				above = interval;
+		} else {
+			below = max(below, interval);
+		}
+	}
+
+	/*
+	 * Use the closest interval not shorter than requested, or the closest
+	 * shorter one. If none fits, the slowest frame rate is the best effort.
+	 */
+	if (above)
+		return above;
+	if (below)
+		return below;
+	return slowest;
+}
+
 /* ---------------------------------------------------------------------------
  * Request processing
  */
 
+/*
+ * Compute the maximum size in bytes of a frame. Uncompressed frames have a
+ * fixed size. For compressed frames, use the worst case size from the frame
+ * descriptor, and fall back to 2 bytes per pixel if it's unknown.
+ */
+static unsigned int
+uvc_frame_size(const struct uvc_function_config_format *format,
+	       const struct uvc_function_config_frame *frame)
+{
+	if (format->bpp)
+		return frame->width * frame->height * format->bpp / 8;
+
+	return frame->max_frame_size ? : frame->width * frame->height * 2;
+}
+
 static void
 uvc_fill_streaming_control(struct uvc_device *dev,
 			   struct uvc_streaming_control *ctrl,
 			   int iformat, int iframe, unsigned int ival)
 {
+	const struct uvc_function_config_endpoint *ep = &dev->fc->streaming.ep;
 	const struct uvc_function_config_format *format;
 	const struct uvc_function_config_frame *frame;
-	unsigned int i;
+	unsigned int frame_size;
 
 	/*
 	 * Restrict the iformat, iframe and ival to valid values. Negative
@@ -144,15 +285,14 @@ uvc_fill_streaming_control(struct uvc_device *dev,
 	iframe = clamp((unsigned int)iframe, 1U, format->num_frames);
 	frame = &format->frames[iframe-1];
 
-	for (i = 0; i < frame->num_intervals; ++i) {
-		if (ival <= frame->intervals[i]) {
-			ival = frame->intervals[i];
-			break;
-		}
-	}
+	frame_size = uvc_frame_size(format, frame);
 
-	if (i == frame->num_intervals)
-		ival = frame->intervals[frame->num_intervals-1];
+	/*
+	 * Steer the host to an interval the endpoint can sustain. The size of
+	 * compressed frames isn't known in advance, they're not constrained.
+	 */
+	ival = uvc_select_frame_interval(ep, dev->speed, frame,
+					 format->bpp ? frame_size : 0, ival);
 
 	memset(ctrl, 0, sizeof *ctrl);
 
@@ -160,23 +300,223 @@ uvc_fill_streaming_control(struct uvc_device *dev,
 	ctrl->bFormatIndex = iformat;
 	ctrl->bFrameIndex = iframe ;
 	ctrl->dwFrameInterval = ival;
+	ctrl->dwMaxVideoFrameSize = frame_size;
+	ctrl->dwMaxPayloadTransferSize =
+		uvc_payload_transfer_size(ep, dev->speed);
+	ctrl->bmFramingInfo = 3;
+	ctrl->bPreferedVersion = 1;
+	ctrl->bMaxVersion = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Probe and commit table
+ *
+ * Hosts issue many probe requests when enumerating the device. The responses
+ * for all combinations of format, frame and interval are computed by
+ * uvc_fill_streaming_control() when the configuration is set, and requests
+ * are then answered with a lookup.
+ */
+
+static void uvc_probe_table_free(struct uvc_device *dev)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < dev->num_probe_formats; ++i) {
+		struct uvc_probe_format *pformat = &dev->probe_formats[i];
+
+		for (j = 0; j < pformat->num_frames; ++j) {
+			struct uvc_probe_frame *pframe = &pformat->frames[j];
+
+			free(pframe->intervals);
+			free(pframe->select);
+			free(pframe->controls);
+		}
+
+		free(pformat->frames);
+	}
+
+	free(dev->probe_formats);
+	dev->probe_formats = NULL;
+	dev->num_probe_formats = 0;
+}
+
+static int uint_compare(const void *a, const void *b)
+{
+	unsigned int ua = *(const unsigned int *)a;
+	unsigned int ub = *(const unsigned int *)b;
+
+	return ua < ub ? -1 : ua > ub ? 1 : 0;
+}
+
+static int uvc_probe_frame_build(struct uvc_device *dev,
+				 struct uvc_probe_frame *pframe,
+				 unsigned int iformat, unsigned int iframe)
+{
+	const struct uvc_function_config_endpoint *ep = &dev->fc->streaming.ep;
+	const struct uvc_function_config_format *format =
+		&dev->fc->streaming.formats[iformat - 1];
+	const struct uvc_function_config_frame *frame =
+		&format->frames[iframe - 1];
+	unsigned int frame_size = uvc_frame_size(format, frame);
+	unsigned int n = frame->num_intervals;
+	int last_fit = -1;
+	int next_fit = -1;
+	unsigned int i;
+
+	if (!n)
+		return -EINVAL;
+
+	pframe->num_intervals = n;
+	pframe->intervals = malloc(sizeof *pframe->intervals * n);
+	pframe->select = malloc(sizeof *pframe->select * (n + 1));
+	pframe->controls = malloc(sizeof *pframe->controls * n);
+	if (!pframe->intervals || !pframe->select || !pframe->controls)
+		return -ENOMEM;
+
+	memcpy(pframe->intervals, frame->intervals,
+	       sizeof *pframe->intervals * n);
+	qsort(pframe->intervals, n, sizeof *pframe->intervals, uint_compare);
+
+	for (i = 0; i < n; ++i) {
+		uvc_fill_streaming_control(dev, &pframe->controls[i], iformat,
+					   iframe, pframe->intervals[i]);
+
+		/* Compressed frames are not constrained by the bandwidth. */
+		if (!format->bpp ||
+		    uvc_frame_fits_bandwidth(ep, dev->speed, frame_size,
+					     pframe->intervals[i]))
+			last_fit = i;
+	}
+
+	if (last_fit < 0)
+		printf("%ux%u frames exceed the endpoint bandwidth at any interval\n",
+		       frame->width, frame->height);
 
 	/*
-	 * The maximum size in bytes for a single frame depends on the format.
-	 * This switch will need extending for any new formats that are added
-	 * to ensure the buffer size calculations are done correctly.
+	 * Mirror uvc_select_frame_interval(): select the first interval that
+	 * fits, starting at the requested one, or the longest interval that
+	 * fits, or the longest interval if none fits.
 	 */
-	switch (format->fcc) {
-	case V4L2_PIX_FMT_YUYV:
-	case V4L2_PIX_FMT_MJPEG:
-		ctrl->dwMaxVideoFrameSize = frame->width * frame->height * 2;
-		break;
+	pframe->select[n] = last_fit >= 0 ? (unsigned int)last_fit : n - 1;
+
+	for (i = n; i-- > 0; ) {
+		if (!format->bpp ||
+		    uvc_frame_fits_bandwidth(ep, dev->speed, frame_size,
+					     pframe->intervals[i]))
+			next_fit = i;
+
+		pframe->select[i] = next_fit >= 0 ? (unsigned int)next_fit
+						  : pframe->select[n];
 	}
 
-	ctrl->dwMaxPayloadTransferSize = dev->fc->streaming.ep.wMaxPacketSize;
-	ctrl->bmFramingInfo = 3;
-	ctrl->bPreferedVersion = 1;
-	ctrl->bMaxVersion = 1;
+	return 0;
+}
+
+static int uvc_probe_table_build(struct uvc_device *dev)
+{
+	const struct uvc_function_config_streaming *streaming =
+		&dev->fc->streaming;
+	unsigned int i, j;
+	int ret;
+
+	uvc_probe_table_free(dev);
+
+	dev->probe_formats = calloc(streaming->num_formats,
+				    sizeof *dev->probe_formats);
+	if (!dev->probe_formats)
+		return -ENOMEM;
+
+	dev->num_probe_formats = streaming->num_formats;
+
+	for (i = 0; i < streaming->num_formats; ++i) {
+		const struct uvc_function_config_format *format =
+			&streaming->formats[i];
+		struct uvc_probe_format *pformat = &dev->probe_formats[i];
+
+		pformat->frames = calloc(format->num_frames,
+					 sizeof *pformat->frames);
+		if (!pformat->frames) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		pformat->num_frames = format->num_frames;
+
+		for (j = 0; j < format->num_frames; ++j) {
+			ret = uvc_probe_frame_build(dev, &pformat->frames[j],
+						    i + 1, j + 1);
+			if (ret < 0)
+				goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	uvc_probe_table_free(dev);
+	return ret;
+}
+
+/*
+ * Fill the response to a probe or commit request. Negative values for iformat
+ * or iframe select the maximum valid value.
+ */
+static void uvc_probe_lookup(struct uvc_device *dev,
+			     struct uvc_streaming_control *ctrl,
+			     int iformat, int iframe, unsigned int ival)
+{
+	const struct uvc_probe_format *pformat;
+	const struct uvc_probe_frame *pframe;
+	unsigned int low, high;
+
+	/* Compute the response if the table couldn't be built. */
+	if (!dev->probe_formats) {
+		uvc_fill_streaming_control(dev, ctrl, iformat, iframe, ival);
+		return;
+	}
+
+	iformat = clamp((unsigned int)iformat, 1U, dev->num_probe_formats);
+	pformat = &dev->probe_formats[iformat - 1];
+
+	iframe = clamp((unsigned int)iframe, 1U, pformat->num_frames);
+	pframe = &pformat->frames[iframe - 1];
+
+	/* Find the first interval not shorter than requested. */
+	low = 0;
+	high = pframe->num_intervals;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+
+		if (pframe->intervals[mid] < ival)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*ctrl = pframe->controls[pframe->select[low]];
+}
+
+/*
+ * Check if the format, frame and interval requested by the host are valid and
+ * fit the endpoint bandwidth.
+ */
+static bool uvc_probe_is_valid(struct uvc_device *dev,
+			       const struct uvc_streaming_control *ctrl)
+{
+	struct uvc_streaming_control resp;
+
+	if (!ctrl->bFormatIndex || ctrl->bFormatIndex > dev->num_probe_formats)
+		return false;
+
+	if (!ctrl->bFrameIndex ||
+	    ctrl->bFrameIndex > dev->probe_formats[ctrl->bFormatIndex - 1].num_frames)
+		return false;
+
+	uvc_probe_lookup(dev, &resp, ctrl->bFormatIndex, ctrl->bFrameIndex,
+			 ctrl->dwFrameInterval);
+
+	return resp.dwFrameInterval == ctrl->dwFrameInterval;
 }
 
 static void
@@ -191,15 +531,32 @@ uvc_events_process_standard(struct uvc_device *dev,
 }
 
 static void
-uvc_events_process_control(struct uvc_device *dev, uint8_t req, uint8_t cs, uint8_t len,
+uvc_events_process_control(struct uvc_device *dev, uint8_t req, uint8_t unit,
+			   uint8_t cs, uint16_t len,
 			   struct uvc_request_data *resp)
 {
-	printf("control request (req %s cs %s)\n", uvc_request_name(req), pu_control_name(cs));
-	(void)dev;
+	printf("control request (req %s unit %u cs %s)\n", uvc_request_name(req),
+	       unit, pu_control_name(cs));
+
+	/*
+	 * Processing Unit requests are answered from the control table.
+	 * Unsupported controls are stalled.
+	 */
+	if (dev->controls && uvc_controls_has_unit(dev->controls, unit)) {
+		if (uvc_controls_request(dev->controls, req, cs, len, resp) < 0)
+			return;
+
+		if (req == UVC_SET_CUR) {
+			dev->control = cs;
+			dev->control_unit = unit;
+		}
+		return;
+	}
 
 	/*
-	 * Responding to controls is not currently implemented. As an interim
-	 * measure respond to say that both get and set operations are permitted.
+	 * Responding to controls of other units is not currently implemented.
+	 * As an interim measure respond to say that both get and set operations
+	 * are permitted.
 	 */
 	resp->data[0] = 0x03;
 	resp->length = len;
@@ -236,9 +593,9 @@ uvc_events_process_streaming(struct uvc_device *dev, uint8_t req, uint8_t cs,
 	case UVC_GET_MAX:
 	case UVC_GET_DEF:
 		if (req == UVC_GET_MAX)
-			uvc_fill_streaming_control(dev, ctrl, -1, -1, UINT_MAX);
+			uvc_probe_lookup(dev, ctrl, -1, -1, UINT_MAX);
 		else
-			uvc_fill_streaming_control(dev, ctrl, 1, 1, 0);
+			uvc_probe_lookup(dev, ctrl, 1, 1, 0);
 		break;
 
 	case UVC_GET_RES:
@@ -269,7 +626,9 @@ uvc_events_process_class(struct uvc_device *dev,
 		return;
 
 	if (interface == dev->fc->control.intf.bInterfaceNumber)
-		uvc_events_process_control(dev, ctrl->bRequest, ctrl->wValue >> 8, ctrl->wLength, resp);
+		uvc_events_process_control(dev, ctrl->bRequest,
+					   ctrl->wIndex >> 8, ctrl->wValue >> 8,
+					   ctrl->wLength, resp);
 	else if (interface == dev->fc->streaming.intf.bInterfaceNumber)
 		uvc_events_process_streaming(dev, ctrl->bRequest, ctrl->wValue >> 8, resp);
 }
@@ -280,6 +639,7 @@ uvc_events_process_setup(struct uvc_device *dev,
 			 struct uvc_request_data *resp)
 {
 	dev->control = 0;
+	dev->control_unit = 0;
 
 	printf("bRequestType %02x bRequest %02x wValue %04x wIndex %04x "
 		"wLength %04x\n", ctrl->bRequestType, ctrl->bRequest,
@@ -307,6 +667,13 @@ uvc_events_process_data(struct uvc_device *dev,
 		(const struct uvc_streaming_control *)&data->data;
 	struct uvc_streaming_control *target;
 
+	if (dev->control_unit) {
+		printf("setting control %s, length = %d\n",
+		       pu_control_name(dev->control), data->length);
+		uvc_controls_set_cur(dev->controls, dev->control, data);
+		return;
+	}
+
 	switch (dev->control) {
 	case UVC_VS_PROBE_CONTROL:
 		printf("setting probe control, length = %d\n", data->length);
@@ -323,14 +690,18 @@ uvc_events_process_data(struct uvc_device *dev,
 		return;
 	}
 
-	uvc_fill_streaming_control(dev, target, ctrl->bFormatIndex,
-				   ctrl->bFrameIndex, ctrl->dwFrameInterval);
+	if (!uvc_probe_is_valid(dev, ctrl))
+		printf("adjusting invalid request: format %u frame %u interval %u\n",
+		       ctrl->bFormatIndex, ctrl->bFrameIndex,
+		       ctrl->dwFrameInterval);
+
+	uvc_probe_lookup(dev, target, ctrl->bFormatIndex, ctrl->bFrameIndex,
+			 ctrl->dwFrameInterval);
 
 	if (dev->control == UVC_VS_COMMIT_CONTROL) {
 		const struct uvc_function_config_format *format;
 		const struct uvc_function_config_frame *frame;
 		struct v4l2_pix_format pixfmt;
-		unsigned int fps;
 
 		format = &dev->fc->streaming.formats[target->bFormatIndex-1];
 		frame = &format->frames[target->bFrameIndex-1];
@@ -344,15 +715,87 @@ uvc_events_process_data(struct uvc_device *dev,
 		pixfmt.height = frame->height;
 		pixfmt.pixelformat = format->fcc;
 		pixfmt.field = V4L2_FIELD_NONE;
-		if (format->fcc == V4L2_PIX_FMT_MJPEG)
+		if (!format->bpp)
 			pixfmt.sizeimage = target->dwMaxVideoFrameSize;
 
 		uvc_stream_set_format(dev->stream, &pixfmt);
+		uvc_stream_set_frame_interval(dev->stream,
+					      target->dwFrameInterval);
+		uvc_stream_prewarm(dev->stream);
+	}
+}
+
+/* ---------------------------------------------------------------------------
+ * Connection speed
+ *
+ * The payload size and bandwidth depend on the speed the device is connected
+ * at. The speed is read from the UDC when the configuration is set, in case
+ * the device is already connected, and updated by the connect event.
+ */
 
-		/* fps is guaranteed to be non-zero and thus valid. */
-		fps = 1.0 / (target->dwFrameInterval / 10000000.0);
-		uvc_stream_set_frame_rate(dev->stream, fps);
+static const char * const uvc_speed_names[] = {
+	[USB_SPEED_UNKNOWN] = "UNKNOWN",
+	[USB_SPEED_LOW] = "low-speed",
+	[USB_SPEED_FULL] = "full-speed",
+	[USB_SPEED_HIGH] = "high-speed",
+	[USB_SPEED_WIRELESS] = "wireless",
+	[USB_SPEED_SUPER] = "super-speed",
+	[USB_SPEED_SUPER_PLUS] = "super-speed-plus",
+};
+
+static enum usb_device_speed uvc_udc_speed(const char *udc)
+{
+	char path[PATH_MAX];
+	char name[32];
+	unsigned int i;
+	FILE *file;
+
+	if (!udc)
+		return USB_SPEED_UNKNOWN;
+
+	snprintf(path, sizeof path, "/sys/class/udc/%s/current_speed", udc);
+
+	file = fopen(path, "r");
+	if (!file)
+		return USB_SPEED_UNKNOWN;
+
+	if (!fgets(name, sizeof name, file))
+		name[0] = '\0';
+	fclose(file);
+
+	name[strcspn(name, "\n")] = '\0';
+
+	for (i = 0; i < ARRAY_SIZE(uvc_speed_names); ++i) {
+		if (!strcmp(name, uvc_speed_names[i]))
+			return i;
 	}
+
+	return USB_SPEED_UNKNOWN;
+}
+
+static void uvc_set_speed(struct uvc_device *dev, enum usb_device_speed speed)
+{
+	int ret;
+
+	if (speed == dev->speed)
+		return;
+
+	printf("Connected at %s\n",
+	       (unsigned int)speed < ARRAY_SIZE(uvc_speed_names)
+	       ? uvc_speed_names[speed] : "UNKNOWN");
+
+	dev->speed = speed;
+
+	ret = uvc_probe_table_build(dev);
+	if (ret < 0)
+		printf("Failed to build probe table: %s (%d)\n",
+		       strerror(-ret), -ret);
+
+	/* Update the payload size of the current probe and commit values. */
+	uvc_probe_lookup(dev, &dev->probe, dev->probe.bFormatIndex,
+			 dev->probe.bFrameIndex, dev->probe.dwFrameInterval);
+	uvc_probe_lookup(dev, &dev->commit, dev->commit.bFormatIndex,
+			 dev->commit.bFrameIndex, dev->commit.dwFrameInterval);
 }
 
 static void uvc_events_process(void *d)
@@ -375,6 +818,9 @@ static void uvc_events_process(void *d)
 
 	switch (v4l2_event.type) {
 	case UVC_EVENT_CONNECT:
+		uvc_set_speed(dev, uvc_event->speed);
+		return;
+
 	case UVC_EVENT_DISCONNECT:
 		return;
 
@@ -411,11 +857,19 @@ void uvc_events_init(struct uvc_device *dev, struct events *events)
 {
 	struct v4l2_event_subscription sub;
 
+	dev->controls = uvc_controls_new(&dev->fc->control, events);
+	if (!dev->controls)
+		printf("Failed to create control table, controls disabled\n");
+	else if (dev->src)
+		uvc_controls_set_video_source(dev->controls, dev->src);
+
 	/* Default to the minimum values. */
-	uvc_fill_streaming_control(dev, &dev->probe, 1, 1, 0);
-	uvc_fill_streaming_control(dev, &dev->commit, 1, 1, 0);
+	uvc_probe_lookup(dev, &dev->probe, 1, 1, 0);
+	uvc_probe_lookup(dev, &dev->commit, 1, 1, 0);
 
 	memset(&sub, 0, sizeof sub);
+	sub.type = UVC_EVENT_CONNECT;
+	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
 	sub.type = UVC_EVENT_SETUP;
 	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
 	sub.type = UVC_EVENT_DATA;
@@ -425,13 +879,33 @@ void uvc_events_init(struct uvc_device *dev, struct events *events)
 	sub.type = UVC_EVENT_STREAMOFF;
 	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
 
-	events_watch_fd(events, dev->vdev->fd, EVENT_EXCEPTION,
-			uvc_events_process, dev);
+	/*
+	 * Hosts enforce tight timeouts on control requests, handle them before
+	 * any pending frame processing.
+	 */
+	events_watch_fd_priority(events, dev->vdev->fd, EVENT_EXCEPTION,
+				 EVENT_PRIORITY_HIGH, uvc_events_process, dev);
 }
 
 void uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc)
 {
+	int ret;
+
 	dev->fc = fc;
+	dev->speed = uvc_udc_speed(fc->udc);
+
+	ret = uvc_probe_table_build(dev);
+	if (ret < 0)
+		printf("Failed to build probe table: %s (%d)\n",
+		       strerror(-ret), -ret);
+}
+
+void uvc_set_video_source(struct uvc_device *dev, struct video_source *src)
+{
+	dev->src = src;
+
+	if (dev->controls)
+		uvc_controls_set_video_source(dev->controls, src);
 }
 
 int uvc_set_format(struct uvc_device *dev, struct v4l2_pix_format *format)
@@ -10,17 +10,80 @@
 #ifndef __UVC_H__
 #define __UVC_H__
 
+#include <linux/usb/ch9.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 struct events;
 struct v4l2_device;
+struct v4l2_pix_format;
 struct uvc_device;
 struct uvc_function_config;
+struct uvc_function_config_endpoint;
+struct uvc_function_config_frame;
 struct uvc_stream;
+struct video_source;
 
 struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream);
 void uvc_close(struct uvc_device *dev);
 void uvc_events_init(struct uvc_device *dev, struct events *events);
 void uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc);
+void uvc_set_video_source(struct uvc_device *dev, struct video_source *src);
 int uvc_set_format(struct uvc_device *dev, struct v4l2_pix_format *format);
 struct v4l2_device *uvc_v4l2_device(struct uvc_device *dev);
 
+/*
+ * uvc_payload_transfer_size - Compute the maximum payload per service interval
+ * @ep: the streaming endpoint parameters
+ * @speed: the speed the device is connected at
+ *
+ * Return the number of bytes the endpoint can transfer per service interval,
+ * reported to the host in dwMaxPayloadTransferSize. Bursts only exist on
+ * super-speed, bMaxBurst is ignored at lower speeds.
+ */
+uint32_t uvc_payload_transfer_size(const struct uvc_function_config_endpoint *ep,
+				   enum usb_device_speed speed);
+
+/*
+ * uvc_endpoint_bandwidth - Compute the video bandwidth of the endpoint
+ * @ep: the streaming endpoint parameters
+ * @speed: the speed the device is connected at
+ *
+ * Return the number of bytes of video data per second the endpoint can
+ * transfer, excluding the payload headers.
+ */
+uint64_t uvc_endpoint_bandwidth(const struct uvc_function_config_endpoint *ep,
+				enum usb_device_speed speed);
+
+/*
+ * uvc_frame_fits_bandwidth - Check if a frame rate fits the endpoint bandwidth
+ * @ep: the streaming endpoint parameters
+ * @speed: the speed the device is connected at
+ * @frame_size: the maximum frame size in bytes
+ * @interval: the frame interval in 100ns units
+ */
+bool uvc_frame_fits_bandwidth(const struct uvc_function_config_endpoint *ep,
+			      enum usb_device_speed speed,
+			      unsigned int frame_size, unsigned int interval);
+
+/*
+ * uvc_select_frame_interval - Select the frame interval to negotiate
+ * @ep: the streaming endpoint parameters
+ * @speed: the speed the device is connected at
+ * @frame: the frame descriptor
+ * @frame_size: the maximum frame size in bytes, 0 for no bandwidth constraint
+ * @ival: the frame interval requested by the host, in 100ns units
+ *
+ * Select the frame interval of @frame closest to @ival, preferring longer
+ * intervals, among the intervals that fit the endpoint bandwidth. When no
+ * interval fits, the longest interval is selected.
+ *
+ * Return the selected interval.
+ */
+unsigned int
+uvc_select_frame_interval(const struct uvc_function_config_endpoint *ep,
+			  enum usb_device_speed speed,
+			  const struct uvc_function_config_frame *frame,
+			  unsigned int frame_size, unsigned int ival);
+
 #endif /* __UVC_H__ */
@@ -21,6 +21,7 @@ struct v4l2_source {
 	struct video_source src;
 
 	struct v4l2_device *vdev;
+	int watch;
 };
 
 #define to_v4l2_source(s) container_of(s, struct v4l2_source, src)
@@ -54,11 +55,12 @@ static int v4l2_source_set_format(struct video_source *s,
 	return v4l2_set_format(src->vdev, fmt);
 }
 
-static int v4l2_source_set_frame_rate(struct video_source *s, unsigned int fps)
+static int v4l2_source_set_frame_interval(struct video_source *s,
+					  unsigned int interval)
 {
 	struct v4l2_source *src = to_v4l2_source(s);
 
-	return v4l2_set_frame_rate(src->vdev, fps);
+	return v4l2_set_frame_interval(src->vdev, interval);
 }
 
 static int v4l2_source_alloc_buffers(struct video_source *s, unsigned int nbufs)
@@ -125,8 +127,14 @@ static int v4l2_source_stream_on(struct video_source *s)
 	if (ret < 0)
 		return ret;
 
-	events_watch_fd(src->src.events, src->vdev->fd, EVENT_READ,
-			v4l2_source_video_process, src);
+	ret = events_watch_fd(src->src.events, src->vdev->fd, EVENT_READ,
+			      v4l2_source_video_process, src);
+	if (ret < 0) {
+		v4l2_stream_off(src->vdev);
+		return ret;
+	}
+
+	src->watch = ret;
 
 	return 0;
 }
@@ -135,7 +143,8 @@ static int v4l2_source_stream_off(struct video_source *s)
 {
 	struct v4l2_source *src = to_v4l2_source(s);
 
-	events_unwatch_fd(src->src.events, src->vdev->fd, EVENT_READ);
+	events_unwatch(src->src.events, src->watch);
+	src->watch = -1;
 
 	return v4l2_stream_off(src->vdev);
 }
@@ -148,16 +157,43 @@ static int v4l2_source_queue_buffer(struct video_source *s,
 	return v4l2_queue_buffer(src->vdev, buf);
 }
 
+static int v4l2_source_query_control(struct video_source *s,
+				     struct v4l2_queryctrl *query)
+{
+	struct v4l2_source *src = to_v4l2_source(s);
+
+	return v4l2_query_control(src->vdev, query);
+}
+
+static int v4l2_source_get_controls(struct video_source *s, unsigned int count,
+				    struct v4l2_ext_control *ctrls)
+{
+	struct v4l2_source *src = to_v4l2_source(s);
+
+	return v4l2_get_controls(src->vdev, count, ctrls);
+}
+
+static int v4l2_source_set_controls(struct video_source *s, unsigned int count,
+				    struct v4l2_ext_control *ctrls)
+{
+	struct v4l2_source *src = to_v4l2_source(s);
+
+	return v4l2_set_controls(src->vdev, count, ctrls);
+}
+
 static const struct video_source_ops v4l2_source_ops = {
 	.destroy = v4l2_source_destroy,
 	.set_format = v4l2_source_set_format,
-	.set_frame_rate = v4l2_source_set_frame_rate,
+	.set_frame_interval = v4l2_source_set_frame_interval,
 	.alloc_buffers = v4l2_source_alloc_buffers,
 	.export_buffers = v4l2_source_export_buffers,
 	.free_buffers = v4l2_source_free_buffers,
 	.stream_on = v4l2_source_stream_on,
 	.stream_off = v4l2_source_stream_off,
 	.queue_buffer = v4l2_source_queue_buffer,
+	.query_control = v4l2_source_query_control,
+	.get_controls = v4l2_source_get_controls,
+	.set_controls = v4l2_source_set_controls,
 };
 
 struct video_source *v4l2_video_source_create(const char *devname)
@@ -170,6 +206,7 @@ struct video_source *v4l2_video_source_create(const char *devname)
 
 	memset(src, 0, sizeof *src);
 	src->src.ops = &v4l2_source_ops;
+	src->watch = -1;
 
 	src->vdev = v4l2_open(devname);
 	if (!src->vdev) {
@@ -338,6 +338,18 @@ void v4l2_close(struct v4l2_device *dev)
  * Controls
  */
 
+int v4l2_query_control(struct v4l2_device *dev, struct v4l2_queryctrl *query)
+{
+	int ret;
+
+	/* Unsupported controls are expected, don't log errors. */
+	ret = ioctl(dev->fd, VIDIOC_QUERYCTRL, query);
+	if (ret < 0)
+		return -errno;
+
+	return 0;
+}
+
 int v4l2_get_control(struct v4l2_device *dev, unsigned int id, int32_t *value)
 {
 	struct v4l2_control ctrl;
@@ -384,11 +396,13 @@ int v4l2_get_controls(struct v4l2_device *dev, unsigned int count,
 	controls.controls = ctrls;
 
 	ret = ioctl(dev->fd, VIDIOC_G_EXT_CTRLS, &controls);
-	if (ret < 0)
+	if (ret < 0) {
 		printf("%s: unable to get multiple controls (%d).\n", dev->name,
 		       errno);
+		return -errno;
+	}
 
-	return ret;
+	return 0;
 }
 
 int v4l2_set_controls(struct v4l2_device *dev, unsigned int count,
@@ -402,11 +416,13 @@ int v4l2_set_controls(struct v4l2_device *dev, unsigned int count,
 	controls.controls = ctrls;
 
 	ret = ioctl(dev->fd, VIDIOC_S_EXT_CTRLS, &controls);
-	if (ret < 0)
+	if (ret < 0) {
 		printf("%s: unable to set multiple controls (%d).\n", dev->name,
 		       errno);
+		return -errno;
+	}
 
-	return ret;
+	return 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -501,23 +517,43 @@ int v4l2_set_format(struct v4l2_device *dev, struct v4l2_pix_format *format)
 	return 0;
 }
 
-int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int fps)
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int r = a % b;
+
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+int v4l2_set_frame_interval(struct v4l2_device *dev, unsigned int interval)
 {
 	struct v4l2_streamparm parm;
+	unsigned int div;
 	int ret;
 
+	if (!interval)
+		return -EINVAL;
+
+	/* 29.97 fps is 333667/10000000, keep the fraction exact. */
+	div = gcd(interval, 10000000);
+
 	memset(&parm, 0, sizeof parm);
 	parm.type = dev->type;
-	parm.parm.capture.timeperframe.numerator = 1;
-	parm.parm.capture.timeperframe.denominator = fps;
+	parm.parm.capture.timeperframe.numerator = interval / div;
+	parm.parm.capture.timeperframe.denominator = 10000000 / div;
 
 	ret = ioctl(dev->fd, VIDIOC_S_PARM, &parm);
 	if (ret < 0) {
-		printf("%s: unable to set frame rate (%d).\n", dev->name, errno);
+		printf("%s: unable to set frame interval (%d).\n", dev->name,
+		       errno);
 		return -errno;
 	}
 
-	dev->fps = fps;
+	dev->timeperframe = parm.parm.capture.timeperframe;
 	return 0;
 }
 
@@ -585,6 +621,59 @@ done:
 	return ret;
 }
 
+int v4l2_create_buffers(struct v4l2_device *dev, unsigned int nbufs)
+{
+	struct v4l2_create_buffers create;
+	struct video_buffer *buffers;
+	unsigned int i;
+	int ret;
+
+	if (dev->buffers.nbufs == 0)
+		return -EINVAL;
+
+	memset(&create, 0, sizeof create);
+	create.count = nbufs;
+	create.memory = dev->memtype;
+	create.format.type = dev->type;
+
+	ret = ioctl(dev->fd, VIDIOC_G_FMT, &create.format);
+	if (ret < 0) {
+		printf("%s: unable to get format (%d).\n", dev->name, errno);
+		return -errno;
+	}
+
+	ret = ioctl(dev->fd, VIDIOC_CREATE_BUFS, &create);
+	if (ret < 0) {
+		printf("%s: unable to create buffers (%d).\n", dev->name,
+		       errno);
+		return -errno;
+	}
+
+	if (create.index != dev->buffers.nbufs) {
+		printf("%s: unexpected index %u for new buffers.\n", dev->name,
+		       create.index);
+		return -EINVAL;
+	}
+
+	buffers = realloc(dev->buffers.buffers,
+			  (create.index + create.count) * sizeof *buffers);
+	if (buffers == NULL)
+		return -ENOMEM;
+
+	for (i = create.index; i < create.index + create.count; ++i) {
+		memset(&buffers[i], 0, sizeof buffers[i]);
+		buffers[i].index = i;
+		buffers[i].dmabuf = -1;
+	}
+
+	dev->buffers.buffers = buffers;
+	dev->buffers.nbufs = create.index + create.count;
+
+	printf("%s: %u buffers created.\n", dev->name, create.count);
+
+	return create.count;
+}
+
 int v4l2_free_buffers(struct v4l2_device *dev)
 {
 	struct v4l2_requestbuffers rb;
@@ -735,7 +824,8 @@ int v4l2_mmap_buffers(struct v4l2_device *dev)
 	unsigned int i;
 	int ret;
 
-	if (dev->memtype != V4L2_MEMORY_MMAP)
+	if (dev->memtype != V4L2_MEMORY_MMAP &&
+	    dev->memtype != V4L2_MEMORY_DMABUF)
 		return -EINVAL;
 
 	for (i = 0; i < dev->buffers.nbufs; ++i) {
@@ -747,6 +837,25 @@ int v4l2_mmap_buffers(struct v4l2_device *dev)
 		};
 		void *mem;
 
+		if (buffer->mem)
+			continue;
+
+		if (dev->memtype == V4L2_MEMORY_DMABUF) {
+			if (buffer->dmabuf < 0)
+				return -EINVAL;
+
+			mem = mmap(0, buffer->size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, buffer->dmabuf, 0);
+			if (mem == MAP_FAILED) {
+				printf("%s: unable to map dmabuf %u (%d)\n",
+				       dev->name, i, errno);
+				return -errno;
+			}
+
+			buffer->mem = mem;
+			continue;
+		}
+
 		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0) {
 			printf("%s: unable to query buffer %u (%d).\n",
@@ -814,8 +923,10 @@ int v4l2_queue_buffer(struct v4l2_device *dev, struct video_buffer *buffer)
 	if (dev->memtype == V4L2_MEMORY_DMABUF)
 		buf.m.fd = (unsigned long)dev->buffers.buffers[buffer->index].dmabuf;
 
-	if (dev->type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+	if (dev->type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
 		buf.bytesused = buffer->bytesused;
+		buf.timestamp = buffer->timestamp;
+	}
 
 	ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
 	if (ret < 0) {
@@ -31,7 +31,7 @@ struct v4l2_device
 	struct list_entry formats;
 	struct v4l2_pix_format format;
 	struct v4l2_rect crop;
-	unsigned int fps;
+	struct v4l2_fract timeperframe;
 
 	struct video_buffer_set buffers;
 };
@@ -87,17 +87,17 @@ int v4l2_get_format(struct v4l2_device *dev, struct v4l2_pix_format *format);
 int v4l2_set_format(struct v4l2_device *dev, struct v4l2_pix_format *format);
 
 /*
- * v4l2_set_frame_rate - Set the frame rate
+ * v4l2_set_frame_interval - Set the frame interval
  * @dev: Device instance
- * @fps: Frame rate
+ * @interval: Frame interval in 100ns units
  *
- * Set the frame rate specified by @fps.
- * The device can modify the requested format and size, in which case @dev->fps
- * will be updated to reflect the modified setting.
+ * Set the frame interval specified by @interval, as an exact fraction of a
+ * second. The device can modify the requested interval, in which case
+ * @dev->timeperframe will be updated to reflect the modified setting.
  *
  * Return 0 on success or a negative error code on failure.
  */
-int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int fps);
+int v4l2_set_frame_interval(struct v4l2_device *dev, unsigned int interval);
 
 /*
  * v4l2_get_crop - Retrieve the current crop rectangle
@@ -145,6 +145,23 @@ int v4l2_set_crop(struct v4l2_device *dev, struct v4l2_rect *rect);
 int v4l2_alloc_buffers(struct v4l2_device *dev, enum v4l2_memory memtype,
 		       unsigned int nbufs);
 
+/*
+ * v4l2_create_buffers - Allocate additional buffers for video frames
+ * @dev: Device instance
+ * @nbufs: Number of buffers to add
+ *
+ * Request the driver to allocate @nbufs additional buffers with
+ * VIDIOC_CREATE_BUFS, for the current format and with the memory type of the
+ * buffers previously allocated by v4l2_alloc_buffers(). This can be done while
+ * streaming. The new buffers are appended to the @dev->buffers array, and
+ * @dev->buffers.nbufs is updated accordingly. MMAP buffers must then be mapped
+ * with v4l2_mmap_buffers().
+ *
+ * Return the number of buffers allocated by the driver, which can be lower
+ * than @nbufs, or a negative error code on failure.
+ */
+int v4l2_create_buffers(struct v4l2_device *dev, unsigned int nbufs);
+
 /*
  * v4l2_free_buffers - Free buffers
  * @dev: Device instance
@@ -207,15 +224,16 @@ int v4l2_import_buffers(struct v4l2_device *dev,
  * v4l2_mmap_buffers - Map buffers to application memory space
  * @dev: Device instance
  *
- * Map all the buffers previously allocated by v4l2_alloc_buffers() to the
- * application memory space. The buffer memory can be accessed through the mem
- * field of each entry in the @dev::buffers array.
+ * Map all the buffers previously allocated by v4l2_alloc_buffers() or
+ * v4l2_create_buffers() to the application memory space. The buffer memory can
+ * be accessed through the mem field of each entry in the @dev::buffers array.
+ * Buffers that are already mapped are skipped.
  *
  * Buffers will be automatically unmapped when freed with v4l2_free_buffers().
  *
- * This function can only be called when buffers have been allocated with the
- * memory type set to V4L2_MEMORY_MMAP. If the memory type is different, or if
- * no buffers have been allocated, it will return -EINVAL.
+ * When buffers have been allocated with the memory type set to
+ * V4L2_MEMORY_DMABUF, the dmabufs imported with v4l2_import_buffers() are
+ * mapped instead. For other memory types, this function returns -EINVAL.
  *
  * Return 0 on success or a negative error code on failure.
  */
@@ -298,6 +316,19 @@ int v4l2_stream_on(struct v4l2_device *dev);
  */
 int v4l2_stream_off(struct v4l2_device *dev);
 
+/*
+ * v4l2_query_control - Query the parameters of a control
+ * @dev: Device instance
+ * @query: Control query, with the id field set to the control ID
+ *
+ * Retrieve the type, range and default value of control @query->id and store
+ * them in @query.
+ *
+ * Return 0 on success, -EINVAL if the device doesn't implement the control, or
+ * another negative error code on failure.
+ */
+int v4l2_query_control(struct v4l2_device *dev, struct v4l2_queryctrl *query);
+
 /*
  * v4l2_get_control - Read the value of a control
  * @dev: Device instance
@@ -9,6 +9,7 @@
 
 #include "video-buffers.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -38,3 +39,46 @@ void video_buffer_set_delete(struct video_buffer_set *buffers)
 	free(buffers->buffers);
 	free(buffers);
 }
+
+void video_buffer_queue_init(struct video_buffer_queue *queue)
+{
+	queue->first = 0;
+	queue->count = 0;
+}
+
+int video_buffer_queue_push(struct video_buffer_queue *queue,
+			    const struct video_buffer *buffer)
+{
+	unsigned int index;
+
+	if (queue->count == VIDEO_BUFFER_QUEUE_SIZE)
+		return -ENOSPC;
+
+	index = (queue->first + queue->count) % VIDEO_BUFFER_QUEUE_SIZE;
+	queue->buffers[index] = *buffer;
+	queue->count++;
+
+	return 0;
+}
+
+bool video_buffer_queue_pop(struct video_buffer_queue *queue,
+			    struct video_buffer *buffer)
+{
+	if (!queue->count)
+		return false;
+
+	*buffer = queue->buffers[queue->first];
+	queue->first = (queue->first + 1) % VIDEO_BUFFER_QUEUE_SIZE;
+	queue->count--;
+
+	return true;
+}
+
+const struct video_buffer *
+video_buffer_queue_peek(const struct video_buffer_queue *queue)
+{
+	if (!queue->count)
+		return NULL;
+
+	return &queue->buffers[queue->first];
+}
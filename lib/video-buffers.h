@@ -45,4 +45,30 @@ struct video_buffer_set
 struct video_buffer_set *video_buffer_set_new(unsigned int nbufs);
 void video_buffer_set_delete(struct video_buffer_set *buffers);
 
+#define VIDEO_BUFFER_QUEUE_SIZE		32
+
+/*
+ * struct video_buffer_queue - FIFO of video buffers
+ * @buffers: Circular array of queued buffers
+ * @first: Index of the first queued buffer in the @buffers array
+ * @count: Number of queued buffers
+ *
+ * Buffer queues store buffers waiting to be processed, for instance empty sink
+ * buffers waiting to be filled by a video source.
+ */
+struct video_buffer_queue
+{
+	struct video_buffer buffers[VIDEO_BUFFER_QUEUE_SIZE];
+	unsigned int first;
+	unsigned int count;
+};
+
+void video_buffer_queue_init(struct video_buffer_queue *queue);
+int video_buffer_queue_push(struct video_buffer_queue *queue,
+			    const struct video_buffer *buffer);
+bool video_buffer_queue_pop(struct video_buffer_queue *queue,
+			    struct video_buffer *buffer);
+const struct video_buffer *
+video_buffer_queue_peek(const struct video_buffer_queue *queue);
+
 #endif /* __VIDEO_BUFFERS_H__ */
@@ -7,6 +7,8 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
+#include <errno.h>
+
 #include "video-source.h"
 
 void video_source_set_buffer_handler(struct video_source *src,
@@ -29,9 +31,10 @@ int video_source_set_format(struct video_source *src,
 	return src->ops->set_format(src, fmt);
 }
 
-int video_source_set_frame_rate(struct video_source *src, unsigned int fps)
+int video_source_set_frame_interval(struct video_source *src,
+				    unsigned int interval)
 {
-	return src->ops->set_frame_rate(src, fps);
+	return src->ops->set_frame_interval(src, interval);
 }
 
 int video_source_alloc_buffers(struct video_source *src, unsigned int nbufs)
@@ -71,3 +74,38 @@ void video_source_fill_buffer(struct video_source *src,
 {
 	src->ops->fill_buffer(src, buf);
 }
+
+int video_source_reload(struct video_source *src)
+{
+	if (!src->ops->reload)
+		return -ENOTSUP;
+
+	return src->ops->reload(src);
+}
+
+int video_source_query_control(struct video_source *src,
+			       struct v4l2_queryctrl *query)
+{
+	if (!src->ops->query_control)
+		return -ENOTSUP;
+
+	return src->ops->query_control(src, query);
+}
+
+int video_source_get_controls(struct video_source *src, unsigned int count,
+			      struct v4l2_ext_control *ctrls)
+{
+	if (!src->ops->get_controls)
+		return -ENOTSUP;
+
+	return src->ops->get_controls(src, count, ctrls);
+}
+
+int video_source_set_controls(struct video_source *src, unsigned int count,
+			      struct v4l2_ext_control *ctrls)
+{
+	if (!src->ops->set_controls)
+		return -ENOTSUP;
+
+	return src->ops->set_controls(src, count, ctrls);
+}
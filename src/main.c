@@ -7,26 +7,43 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
+#include <errno.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/signalfd.h>
+
+#include <linux/videodev2.h>
+
 #include "configfs.h"
 #include "events.h"
+#include "fanout-source.h"
 #include "stream.h"
 #include "v4l2-source.h"
 #include "test-source.h"
 #include "jpg-source.h"
 #include "slideshow-source.h"
+#include "video-source.h"
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [options] <uvc device>\n", argv0);
+	fprintf(stderr, "Usage: %s [options] [<uvc device> ...]\n", argv0);
 	fprintf(stderr, "Available options are\n");
+	fprintf(stderr, " -a cpu		Pin the stream threads to consecutive CPUs starting at cpu\n");
+	fprintf(stderr, " -b count	Number of video buffers, 0 for automatic (default: 4)\n");
 	fprintf(stderr, " -c device	V4L2 source device\n");
+	fprintf(stderr, " -f		Prepare streams when the host commits the format, to start faster\n");
 	fprintf(stderr, " -i image	MJPEG image\n");
 	fprintf(stderr, " -s directory	directory of slideshow images\n");
+	fprintf(stderr, " -S device	V4L2 still image source device, captured on SIGUSR2 to the current directory\n");
 	fprintf(stderr, " -h		Print this help screen and exit\n");
+	fprintf(stderr, " -l latency	Log frames whose capture to transfer latency exceeds latency ms\n");
+	fprintf(stderr, " -p priority	Run the stream threads with the SCHED_FIFO policy\n");
+	fprintf(stderr, " -w count	Number of threads filling test pattern buffers ahead (default: 0)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, " <uvc device>	UVC device instance specifier\n");
 	fprintf(stderr, "\n");
@@ -41,123 +58,693 @@ static void usage(const char *argv0)
 	fprintf(stderr, "  The parameter is optional, and if not provided the first UVC function on the first\n");
 	fprintf(stderr, "  gadget identified will be used.\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "  Multiple UVC devices can be given to serve them all from a single process, each\n");
+	fprintf(stderr, "  with its own stream thread. The -c, -i and -s options are assigned to the devices\n");
+	fprintf(stderr, "  in the order they appear, and devices without a source use the test pattern.\n");
+	fprintf(stderr, "  The -S option is assigned to the devices in the same way.\n");
+	fprintf(stderr, "  Devices given the same V4L2 source device share its buffers without copies, and\n");
+	fprintf(stderr, "  run in the same stream thread.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "Example usage:\n");
 	fprintf(stderr, "    %s uvc.1\n", argv0);
 	fprintf(stderr, "    %s g1/functions/uvc.1\n", argv0);
+	fprintf(stderr, "    %s -c /dev/video0 -i image.jpg uvc.0 uvc.1\n", argv0);
+	fprintf(stderr, "    %s -c /dev/video0 -c /dev/video0 uvc.0 uvc.1\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "    %s musb-hdrc.0.auto\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Signals:\n");
+	fprintf(stderr, "    SIGINT, SIGTERM	Stop streaming and exit\n");
+	fprintf(stderr, "    SIGHUP		Reload the image or slideshow files\n");
+	fprintf(stderr, "    SIGUSR1		Print the stream and event loop statistics\n");
+	fprintf(stderr, "    SIGUSR2		Capture a still image at the largest size of the -S devices\n");
+}
+
+#define APP_MAX_WATCHES		16
+
+/* V4L2 devices adjust the still image size to the largest one they support. */
+#define APP_STILL_MAX_SIZE	65535
+
+enum app_source_type {
+	APP_SOURCE_TEST,
+	APP_SOURCE_V4L2,
+	APP_SOURCE_JPG,
+	APP_SOURCE_SLIDESHOW,
+};
+
+struct app;
+
+/*
+ * struct app_function - Per-function state
+ * @app: The application
+ * @name: The UVC function name, NULL for the first function found
+ * @source_type: The video source type
+ * @source_arg: The video source argument (device, image or directory)
+ * @fc: The function configuration
+ * @owner: The function owning the event loop and fan-out source, which is the
+ *	function itself unless it shares a capture device with a previous function
+ * @shared: True if the capture device is shared with other functions
+ * @running: True if the stream thread is running
+ * @events: Stream thread event loop
+ * @fanout: Fan-out source for a shared capture device
+ * @src: The video source
+ * @still_arg: The still image V4L2 source device, NULL if stills are disabled
+ * @still_src: The still image video source
+ * @stills: Number of still images saved
+ * @stream: The UVC stream
+ */
+struct app_function {
+	struct app *app;
+	const char *name;
+	enum app_source_type source_type;
+	const char *source_arg;
+	struct uvc_function_config *fc;
+	struct app_function *owner;
+	bool shared;
+	bool running;
+	struct events events;
+	struct fanout_source *fanout;
+	struct video_source *src;
+	const char *still_arg;
+	struct video_source *still_src;
+	unsigned int stills;
+	struct uvc_stream *stream;
+};
+
+/*
+ * struct app - Application state used by the signal handlers
+ * @events: Main thread event loop, handling signals
+ * @functions: The UVC functions
+ * @num_functions: Number of entries in @functions
+ * @signal_fd: signalfd receiving the handled signals
+ */
+struct app {
+	struct events events;
+	struct app_function *functions;
+	unsigned int num_functions;
+	int signal_fd;
+};
+
+/*
+ * struct app_stats - Snapshot of the stream and event loop statistics
+ * @function: The function the statistics relate to
+ * @stream: Stream statistics
+ * @has_events: True if @events and @watches are valid
+ * @events: Event loop statistics
+ * @num_watches: Number of valid entries in @watches
+ * @watches: Per-watch statistics
+ */
+struct app_stats {
+	struct app_function *function;
+	struct uvc_stream_stats stream;
+	bool has_events;
+	struct events_stats events;
+	unsigned int num_watches;
+	struct events_watch_stats watches[APP_MAX_WATCHES];
+};
+
+static const char *app_function_name(struct app_function *func)
+{
+	return func->name ? func->name : func->fc->video;
 }
 
-/* Necessary for and only used by signal handler. */
-static struct events *sigint_events;
+static void app_print_latency(const char *name,
+			      const struct histogram_summary *summary)
+{
+	printf("  %-12s %10llu  min %8llu  p50 %8llu  p90 %8llu  p99 %8llu  max %8llu us\n",
+	       name, (unsigned long long)summary->count,
+	       (unsigned long long)summary->min / 1000,
+	       (unsigned long long)summary->p50 / 1000,
+	       (unsigned long long)summary->p90 / 1000,
+	       (unsigned long long)summary->p99 / 1000,
+	       (unsigned long long)summary->max / 1000);
+}
+
+/* Called in the main thread. */
+static void app_print_stats(void *d)
+{
+	struct app_stats *stats = d;
+	const struct uvc_stream_stats *stream = &stats->stream;
+	unsigned int i;
+
+	printf("%s stream: %llu frames, %llu bytes, %u/%u/%u buffers (sink/source/total)\n",
+	       app_function_name(stats->function),
+	       (unsigned long long)stream->sink_dequeued,
+	       (unsigned long long)stream->bytes,
+	       stream->sink_buffers, stream->source_buffers, stream->buffers);
+	printf("  queued %llu/%llu, completed %llu/%llu (sink/source)\n",
+	       (unsigned long long)stream->sink_queued,
+	       (unsigned long long)stream->source_queued,
+	       (unsigned long long)stream->sink_dequeued,
+	       (unsigned long long)stream->source_dequeued);
+	printf("  errors %llu/%llu (sink/source), %llu underruns, %llu dropped, %llu repeated\n",
+	       (unsigned long long)stream->sink_errors,
+	       (unsigned long long)stream->source_errors,
+	       (unsigned long long)stream->underruns,
+	       (unsigned long long)stream->dropped,
+	       (unsigned long long)stream->repeated);
+	if (stream->time_to_first_frame)
+		printf("  first frame after %llu us\n",
+		       (unsigned long long)stream->time_to_first_frame / 1000);
+	app_print_latency("interval", &stream->interval);
+	app_print_latency("latency", &stream->latency);
+	app_print_latency("queue", &stream->queue_latency);
+	app_print_latency("transfer", &stream->transfer_latency);
+
+	if (!stats->has_events) {
+		free(stats);
+		return;
+	}
+
+	printf("%s event loop: %llu iterations, %llu dispatches\n",
+	       app_function_name(stats->function),
+	       (unsigned long long)stats->events.iterations,
+	       (unsigned long long)stats->events.dispatches);
+	app_print_latency("wait", &stats->events.wait);
+	app_print_latency("delay", &stats->events.delay);
+
+	for (i = 0; i < stats->num_watches; ++i) {
+		const struct events_watch_stats *watch = &stats->watches[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "fd %d/%s", watch->fd,
+			 watch->type == EVENT_READ ? "r" :
+			 watch->type == EVENT_WRITE ? "w" : "x");
+		app_print_latency(name, &watch->callback);
+	}
+
+	free(stats);
+}
+
+/*
+ * Called in the stream thread. Only take a snapshot of the statistics there,
+ * and print them from the main thread to keep the frame path unaffected.
+ */
+static void app_snapshot_stats(void *d)
+{
+	struct app_function *func = d;
+	struct app_stats *stats;
+	int ret;
+
+	stats = malloc(sizeof(*stats));
+	if (!stats)
+		return;
+
+	stats->function = func;
+	stats->has_events = false;
+	stats->num_watches = 0;
+
+	uvc_stream_get_stats(func->stream, &stats->stream);
+
+	/* Event loops shared by multiple functions are reported once. */
+	if (func->owner == func &&
+	    events_get_stats(&func->events, &stats->events) == 0) {
+		stats->has_events = true;
+
+		ret = events_get_watch_stats(&func->events, stats->watches,
+					     APP_MAX_WATCHES);
+		stats->num_watches = ret < 0 ? 0 : ret < APP_MAX_WATCHES ? ret
+				   : APP_MAX_WATCHES;
+	}
+
+	if (events_post(&func->app->events, app_print_stats, stats) < 0)
+		free(stats);
+}
+
+/* Called in the stream thread. */
+static void app_reload(void *d)
+{
+	struct app_function *func = d;
+	int ret;
+
+	ret = uvc_stream_reload_video_source(func->stream, func->src);
+	if (ret < 0 && ret != -ENOTSUP)
+		printf("%s: failed to reload video source: %s (%d)\n",
+		       app_function_name(func), strerror(-ret), -ret);
+}
+
+/* Called in the stream thread. */
+static void app_capture_still(void *d)
+{
+	struct app_function *func = d;
+	struct v4l2_pix_format format = {
+		.width = APP_STILL_MAX_SIZE,
+		.height = APP_STILL_MAX_SIZE,
+		.field = V4L2_FIELD_NONE,
+	};
+	int ret;
+
+	ret = uvc_stream_capture_still(func->stream, &format);
+	if (ret < 0)
+		printf("%s: failed to capture still image: %s (%d)\n",
+		       app_function_name(func), strerror(-ret), -ret);
+}
+
+/* Called in the main thread. */
+static void app_process_signals(void *d)
+{
+	struct app *app = d;
+	struct signalfd_siginfo info;
+	unsigned int i;
+
+	while (read(app->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			/* Stop the main loop, the streams are then stopped. */
+			events_stop(&app->events);
+			break;
+
+		case SIGHUP:
+			for (i = 0; i < app->num_functions; ++i)
+				events_post(&app->functions[i].owner->events,
+					    app_reload, &app->functions[i]);
+			break;
+
+		case SIGUSR1:
+			for (i = 0; i < app->num_functions; ++i) {
+				struct app_function *func = &app->functions[i];
+
+				events_post(&func->owner->events,
+					    app_snapshot_stats, func);
+			}
+			break;
+
+		case SIGUSR2:
+			for (i = 0; i < app->num_functions; ++i) {
+				struct app_function *func = &app->functions[i];
+
+				if (func->still_src)
+					events_post(&func->owner->events,
+						    app_capture_still, func);
+			}
+			break;
+		}
+	}
+}
+
+static int app_init_signals(struct app *app)
+{
+	sigset_t mask;
+	int ret;
+
+	/*
+	 * Block the signals and receive them through a signalfd, handled from
+	 * the main event loop. This avoids running any code in signal context.
+	 * The mask must be set before creating threads, to be inherited.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	app->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (app->signal_fd < 0) {
+		printf("Failed to create signalfd: %s (%d)\n", strerror(errno),
+		       errno);
+		return -errno;
+	}
+
+	ret = events_watch_fd(&app->events, app->signal_fd, EVENT_READ,
+			      app_process_signals, app);
+	if (ret < 0) {
+		close(app->signal_fd);
+		app->signal_fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Called in the stream thread. */
+static void app_save_still(void *d, const struct v4l2_pix_format *format,
+			   const void *mem, unsigned int size)
+{
+	struct app_function *func = d;
+	char name[64];
+	FILE *file;
+
+	snprintf(name, sizeof(name), "still-%u-%u.%s",
+		 (unsigned int)(func - func->app->functions), func->stills++,
+		 format->pixelformat == V4L2_PIX_FMT_MJPEG ? "jpg" : "raw");
+
+	file = fopen(name, "wb");
+	if (!file) {
+		printf("%s: failed to open %s: %s (%d)\n",
+		       app_function_name(func), name, strerror(errno), errno);
+		return;
+	}
+
+	if (fwrite(mem, 1, size, file) != size)
+		printf("%s: failed to write %s\n", app_function_name(func),
+		       name);
+	else
+		printf("%s: still image saved to %s\n", app_function_name(func),
+		       name);
+
+	fclose(file);
+}
+
+static struct video_source *app_function_create_source(struct app_function *func)
+{
+	struct video_source *upstream;
+
+	if (func->owner != func)
+		return fanout_video_source_create(func->owner->fanout);
+
+	if (func->shared) {
+		upstream = v4l2_video_source_create(func->source_arg);
+		if (!upstream)
+			return NULL;
+
+		v4l2_video_source_init(upstream, &func->events);
+
+		func->fanout = fanout_source_create(upstream);
+		if (!func->fanout) {
+			video_source_destroy(upstream);
+			return NULL;
+		}
+
+		return fanout_video_source_create(func->fanout);
+	}
+
+	switch (func->source_type) {
+	case APP_SOURCE_V4L2:
+		return v4l2_video_source_create(func->source_arg);
+	case APP_SOURCE_JPG:
+		return jpg_video_source_create(func->source_arg);
+	case APP_SOURCE_SLIDESHOW:
+		return slideshow_video_source_create(func->source_arg);
+	case APP_SOURCE_TEST:
+	default:
+		return test_video_source_create();
+	}
+}
 
-static void sigint_handler(int signal __attribute__((unused)))
+static int app_function_init(struct app_function *func, unsigned int nbufs,
+			     unsigned int workers, unsigned int latency,
+			     bool prewarm)
 {
-	/* Stop the main loop when the user presses CTRL-C */
-	events_stop(sigint_events);
+	struct events *events = &func->owner->events;
+	struct video_source *src;
+	struct uvc_stream *stream;
+
+	/* Create and initialize a video source. */
+	src = app_function_create_source(func);
+	if (src == NULL)
+		return -EINVAL;
+
+	func->src = src;
+
+	if (func->owner->fanout) {
+		fanout_video_source_init(src, events);
+	} else {
+		switch (func->source_type) {
+		case APP_SOURCE_V4L2:
+			v4l2_video_source_init(src, events);
+			break;
+		case APP_SOURCE_JPG:
+			jpg_video_source_init(src, events);
+			break;
+		case APP_SOURCE_SLIDESHOW:
+			slideshow_video_source_init(src, events);
+			break;
+		case APP_SOURCE_TEST:
+		default:
+			test_video_source_init(src, events);
+			break;
+		}
+	}
+
+	/* Create and initialise the stream. */
+	stream = uvc_stream_new(func->fc->video);
+	if (stream == NULL)
+		return -EINVAL;
+
+	func->stream = stream;
+
+	uvc_stream_set_event_handler(stream, events);
+	uvc_stream_set_video_source(stream, src);
+	uvc_stream_set_buffer_count(stream, nbufs);
+	uvc_stream_set_fill_workers(stream, workers);
+	uvc_stream_set_latency_threshold(stream, latency * 1000000ULL);
+	uvc_stream_set_prewarm(stream, prewarm);
+
+	if (func->still_arg) {
+		func->still_src = v4l2_video_source_create(func->still_arg);
+		if (!func->still_src)
+			return -EINVAL;
+
+		v4l2_video_source_init(func->still_src, events);
+		uvc_stream_set_still_source(stream, func->still_src,
+					    app_save_still, func);
+	}
+
+	uvc_stream_init_uvc(stream, func->fc);
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	char *function = NULL;
-	char *cap_device = NULL;
-	char *img_path = NULL;
-	char *slideshow_dir = NULL;
+	struct uvc_function_config **fcs = NULL;
+	const char **names = NULL;
+	unsigned int num_sources = 0;
+	unsigned int num_stills = 0;
+	unsigned int num_threads = 0;
+	unsigned int nbufs = 4;
+	unsigned int workers = 0;
+	unsigned int latency = 0;
+	bool prewarm = false;
+	unsigned int i, j;
 
-	struct uvc_function_config *fc;
-	struct uvc_stream *stream = NULL;
-	struct video_source *src = NULL;
-	struct events events;
+	struct app_function *functions = NULL;
+	struct app_function *func;
+	enum app_source_type *source_types;
+	const char **source_args;
+	const char **still_args;
+	struct events_thread_config thread_config = {
+		.cpu = -1,
+		.policy = SCHED_OTHER,
+	};
+	struct app app = {
+		.signal_fd = -1,
+	};
 	int ret = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "c:i:s:k:h")) != -1) {
+	/* There can't be more sources than command line arguments. */
+	source_types = calloc(argc, sizeof(*source_types));
+	source_args = calloc(argc, sizeof(*source_args));
+	still_args = calloc(argc, sizeof(*still_args));
+	if (!source_types || !source_args || !still_args) {
+		ret = 1;
+		goto done;
+	}
+
+	while ((opt = getopt(argc, argv, "a:b:c:fi:l:p:s:S:k:w:h")) != -1) {
 		switch (opt) {
+		case 'a':
+			thread_config.cpu = atoi(optarg);
+			break;
+
+		case 'b':
+			nbufs = atoi(optarg);
+			break;
+
 		case 'c':
-			cap_device = optarg;
+			source_types[num_sources] = APP_SOURCE_V4L2;
+			source_args[num_sources++] = optarg;
+			break;
+
+		case 'f':
+			prewarm = true;
 			break;
 
 		case 'i':
-			img_path = optarg;
+			source_types[num_sources] = APP_SOURCE_JPG;
+			source_args[num_sources++] = optarg;
+			break;
+
+		case 'l':
+			latency = atoi(optarg);
+			break;
+
+		case 'p':
+			thread_config.policy = SCHED_FIFO;
+			thread_config.priority = atoi(optarg);
 			break;
 
 		case 's':
-			slideshow_dir = optarg;
+			source_types[num_sources] = APP_SOURCE_SLIDESHOW;
+			source_args[num_sources++] = optarg;
+			break;
+
+		case 'S':
+			still_args[num_stills++] = optarg;
+			break;
+
+		case 'w':
+			workers = atoi(optarg);
 			break;
 
 		case 'h':
 			usage(argv[0]);
-			return 0;
+			goto done;
 
 		default:
 			fprintf(stderr, "Invalid option '-%c'\n", opt);
 			usage(argv[0]);
-			return 1;
+			ret = 1;
+			goto done;
 		}
 	}
 
-	if (argv[optind] != NULL)
-		function = argv[optind];
+	/*
+	 * Without any function name on the command line, serve the first UVC
+	 * function found.
+	 */
+	app.num_functions = argc > optind ? argc - optind : 1;
 
-	fc = configfs_parse_uvc_function(function);
-	if (!fc) {
-		printf("Failed to identify function configuration\n");
-		return 1;
+	if (num_sources > app.num_functions) {
+		printf("%u video sources specified for %u UVC function%s\n",
+		       num_sources, app.num_functions,
+		       app.num_functions > 1 ? "s" : "");
+		ret = 1;
+		goto done;
 	}
 
-	if (cap_device != NULL && img_path != NULL) {
-		printf("Both capture device and still image specified\n");
-		printf("Please specify only one\n");
-		return 1;
+	if (num_stills > app.num_functions) {
+		printf("%u still image sources specified for %u UVC function%s\n",
+		       num_stills, app.num_functions,
+		       app.num_functions > 1 ? "s" : "");
+		ret = 1;
+		goto done;
 	}
 
-	/*
-	 * Create the events handler. Register a signal handler for SIGINT,
-	 * received when the user presses CTRL-C. This will allow the main loop
-	 * to be interrupted, and resources to be freed cleanly.
-	 */
-	events_init(&events);
+	names = calloc(app.num_functions, sizeof(*names));
+	fcs = calloc(app.num_functions, sizeof(*fcs));
+	functions = calloc(app.num_functions, sizeof(*functions));
+	if (!names || !fcs || !functions) {
+		ret = 1;
+		goto done;
+	}
 
-	sigint_events = &events;
-	signal(SIGINT, sigint_handler);
+	for (i = 0; i < app.num_functions; ++i)
+		names[i] = argv[optind + i];
 
-	/* Create and initialize a video source. */
-	if (cap_device)
-		src = v4l2_video_source_create(cap_device);
-	else if (img_path)
-		src = jpg_video_source_create(img_path);
-	else if (slideshow_dir)
-		src = slideshow_video_source_create(slideshow_dir);
-	else
-		src = test_video_source_create();
-	if (src == NULL) {
+	if (configfs_parse_uvc_functions(names, app.num_functions, fcs) < 0) {
 		ret = 1;
 		goto done;
 	}
 
-	if (cap_device)
-		v4l2_video_source_init(src, &events);
+	app.functions = functions;
 
-	/* Create and initialise the stream. */
-	stream = uvc_stream_new(fc->video);
-	if (stream == NULL) {
+	for (i = 0; i < app.num_functions; ++i) {
+		func = &functions[i];
+		func->app = &app;
+		func->name = names[i];
+		func->fc = fcs[i];
+		func->source_type = i < num_sources ? source_types[i]
+			       : APP_SOURCE_TEST;
+		func->source_arg = i < num_sources ? source_args[i] : NULL;
+		func->still_arg = i < num_stills ? still_args[i] : NULL;
+
+		/*
+		 * Functions capturing from the same device share it through a
+		 * fan-out source, served by the event loop of the first one.
+		 */
+		func->owner = func;
+
+		for (j = 0; j < i && func->source_type == APP_SOURCE_V4L2; ++j) {
+			struct app_function *other = &functions[j];
+
+			if (other->source_type == APP_SOURCE_V4L2 &&
+			    !strcmp(other->source_arg, func->source_arg)) {
+				func->owner = other->owner;
+				func->owner->shared = true;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Create the events handlers. Each stream and its video source run their
+	 * own event loop in a dedicated thread, while the main thread handles
+	 * signals. SIGINT, received when the user presses CTRL-C, and SIGTERM
+	 * interrupt the main loop, allowing resources to be freed cleanly.
+	 */
+	events_init(&app.events);
+	for (i = 0; i < app.num_functions; ++i)
+		events_init(&functions[i].events);
+
+	if (app_init_signals(&app) < 0) {
 		ret = 1;
-		goto done;
+		goto cleanup;
 	}
 
-	uvc_stream_set_event_handler(stream, &events);
-	uvc_stream_set_video_source(stream, src);
-	uvc_stream_init_uvc(stream, fc);
+	for (i = 0; i < app.num_functions; ++i) {
+		if (app_function_init(&functions[i], nbufs, workers,
+				      latency, prewarm) < 0) {
+			ret = 1;
+			goto cleanup;
+		}
+	}
 
-	/* Main capture loop */
-	events_loop(&events);
+	/* Start the stream threads and wait for termination. */
+	for (i = 0; i < app.num_functions; ++i) {
+		struct events_thread_config config = thread_config;
 
-done:
+		func = &functions[i];
+		if (func->owner != func)
+			continue;
+
+		if (config.cpu >= 0)
+			config.cpu += num_threads;
+
+		if (events_start_thread(&func->events, &config) < 0) {
+			ret = 1;
+			break;
+		}
+
+		func->running = true;
+		num_threads++;
+	}
+
+	if (!ret)
+		events_loop(&app.events);
+
+	for (i = 0; i < app.num_functions; ++i) {
+		if (functions[i].running)
+			events_stop_thread(&functions[i].events);
+	}
+
+cleanup:
 	/* Cleanup */
-	uvc_stream_delete(stream);
-	video_source_destroy(src);
-	events_cleanup(&events);
-	configfs_free_uvc_function(fc);
+	for (i = 0; i < app.num_functions; ++i) {
+		uvc_stream_delete(functions[i].stream);
+		video_source_destroy(functions[i].src);
+		video_source_destroy(functions[i].still_src);
+	}
+	for (i = 0; i < app.num_functions; ++i) {
+		fanout_source_destroy(functions[i].fanout);
+		events_cleanup(&functions[i].events);
+		configfs_free_uvc_function(functions[i].fc);
+	}
+	events_cleanup(&app.events);
+	if (app.signal_fd >= 0)
+		close(app.signal_fd);
+
+done:
+	free(functions);
+	free(fcs);
+	free(names);
+	free(still_args);
+	free(source_args);
+	free(source_types);
 
 	return ret;
 }